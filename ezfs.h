@@ -20,6 +20,7 @@ struct ezfs_inode {
 	struct timespec64 i_mtime; /* Modified time */
 	struct timespec64 i_ctime; /* Change time */
 	unsigned int nlink;
+	uint32_t flags; /* EZFS_COMPR_* algorithm the data is stored with */
 
 	/* The device block where the data starts for this file. */
 	uint64_t data_block_number;
@@ -32,6 +33,27 @@ struct ezfs_inode {
 	uint64_t nblocks; /* number of blocks */
 };
 
+/* A compressed file keeps its data in chunks of EZFS_CHUNK_BLOCKS blocks.
+ * The first block of its extent is the chunk map: one ezfs_chunk per chunk,
+ * telling where the chunk lives and how big it is. Chunks that don't shrink
+ * by at least one block are stored raw (length 0).
+ */
+#define EZFS_COMPR_NONE		0
+#define EZFS_COMPR_LZ4		1
+#define EZFS_COMPR_ZSTD		2
+#define EZFS_INODE_COMPR_MASK	0x3
+
+#define EZFS_CHUNK_BLOCKS	4
+#define EZFS_CHUNK_SIZE		(EZFS_CHUNK_BLOCKS * EZFS_BLOCK_SIZE)
+
+struct ezfs_chunk {
+	uint32_t offset; /* first block, counted from the chunk map */
+	uint16_t length; /* compressed bytes, or 0 if stored raw */
+	uint16_t size;   /* bytes of file data in the chunk */
+};
+
+#define EZFS_MAX_CHUNKS (EZFS_BLOCK_SIZE / sizeof(struct ezfs_chunk))
+
 /* Directories store a mapping from filename -> inode number. Each of these
  * mappings is a single "directory entry" and is represented by the struct
  * below.
@@ -49,6 +71,14 @@ struct ezfs_dir_entry {
 #define CLEARBIT(A, k)   (A[((k) / 32)] &= ~(1 << ((k) % 32)))
 #define IS_SET(A, k)     (A[((k) / 32)] &   (1 << ((k) % 32)))
 
+/* Bit k of free_data_blocks tracks device block
+ * k + EZFS_ROOT_DATABLOCK_NUMBER, and bit k of free_inodes tracks inode
+ * number k + EZFS_ROOT_INODE_NUMBER. These macros turn a block or inode
+ * number into its bit index.
+ */
+#define EZFS_DATA_BIT(blk)	((blk) - EZFS_ROOT_DATABLOCK_NUMBER)
+#define EZFS_INODE_BIT(ino)	((ino) - EZFS_ROOT_INODE_NUMBER)
+
 /* This macro will declare a bit vector. I use it to declare an array of the
  * right size inside the ezfs_sb.
  */
@@ -77,14 +107,35 @@ struct ezfs_dir_entry {
  * how many ezfs_inodes we can shove in the inode store.
  */
 #define EZFS_MAX_INODES (EZFS_BLOCK_SIZE / sizeof(struct ezfs_inode)) /* 42 */
-#define EZFS_MAX_DATA_BLKS EZFS_MAX_INODES * 8
+#define EZFS_MAX_DATA_BLKS (EZFS_MAX_INODES * 8)
 #define EZFS_MAX_CHILDREN ((loff_t) (EZFS_BLOCK_SIZE / sizeof(struct ezfs_dir_entry)))
 
 #define EZFS_SB_MEMBERS uint64_t version;\
 	uint64_t magic;\
 	DECLARE_BIT_VECTOR(free_inodes, EZFS_MAX_INODES);\
 	DECLARE_BIT_VECTOR(free_data_blocks, EZFS_MAX_DATA_BLKS);\
-	struct mutex *ezfs_lock;
+	uint64_t unused;\
+	uint8_t block_shares[EZFS_MAX_DATA_BLKS];\
+	uint64_t flags;
+
+/* unused is where older modules kept a pointer to their lock, which is
+ * runtime state and now lives in ezfs_sb_buffer_heads. The field stays so
+ * existing images keep their layout, and the module clears it on a
+ * read-write mount.
+ */
+
+/* block_shares[k] counts how many files share data block
+ * k + EZFS_ROOT_DATABLOCK_NUMBER besides its first owner, after a reflink
+ * (FICLONE). A block only goes back to free_data_blocks once its count is 0.
+ */
+#define EZFS_MAX_BLOCK_SHARES 255
+
+/* Superblock flags. A packed image is built once by format_disk_as_ezfs -p
+ * and only ever mounted read-only: files are laid out back to back and every
+ * directory's entries are sorted by name with no holes, so lookups can
+ * binary search them.
+ */
+#define EZFS_SB_PACKED 0x1
 
 /* This is the superblock, as it will be serialized onto the disk. */
 struct ezfs_super_block {
@@ -94,12 +145,101 @@ struct ezfs_super_block {
 	char __padding__[EZFS_BLOCK_SIZE - sizeof(struct {EZFS_SB_MEMBERS})];
 };
 
+/* How ezfs_alloc_range picks a free run of blocks, in the module and in
+ * libezfs.
+ */
+#define EZFS_ALLOC_FIRST	0 /* lowest run that fits */
+#define EZFS_ALLOC_NEXT		1 /* first run that fits after the last one */
+#define EZFS_ALLOC_BEST		2 /* smallest run that fits */
+
+#ifdef __KERNEL__
+/* Options given at mount time. All of them can be changed on remount. */
+struct ezfs_mount_opts {
+	bool discard; /* discard blocks on the device once they're freed */
+	unsigned int compress; /* EZFS_COMPR_* for files that have no data */
+	bool dir_prefetch; /* readdir warms the inode cache for children */
+	unsigned int alloc; /* EZFS_ALLOC_* */
+	unsigned int headroom; /* % of extra blocks to take when a file grows */
+	unsigned int reserved; /* % of data blocks kept for CAP_SYS_RESOURCE */
+	unsigned int commit; /* seconds between metadata commits, 0 for none */
+};
+
+/* Per-mount counters, kept per CPU so lookups on different CPUs don't
+ * bounce a cache line, and summed when debugfs ezfs/<device>/stats is read.
+ * Lock times go into histograms: bucket 0 counts waits and holds under 1us,
+ * bucket k those between 2^(k-1) and 2^k us, and the last bucket the rest.
+ */
+#define EZFS_HIST_BUCKETS 16
+
+struct ezfs_stats {
+	u64 blocks_relocated;
+	u64 bytes_moved;
+	u64 lookups;
+	u64 lookup_probes;
+	u64 allocs;
+	u64 alloc_scanned;
+	u64 lock_wait[EZFS_HIST_BUCKETS];
+	u64 lock_hold[EZFS_HIST_BUCKETS];
+};
+
 /* In the VFS superblock, we need to have a pointer to the buffer_heads for the
  * inode store and superblock so that we can mark them as dirty when they're
  * modified inode.
  */
 struct ezfs_sb_buffer_heads {
+	struct super_block *sb;
 	struct buffer_head *sb_bh;
 	struct buffer_head *i_store_bh;
+
+	struct ezfs_mount_opts opts;
+	bool packed; /* EZFS_SB_PACKED image, no locking or allocation */
+	uint64_t data_blocks; /* data blocks the device really has */
+
+	struct ezfs_stats __percpu *stats;
+	u64 lock_taken; /* when ezfs_lock was last acquired, in ns */
+	struct dentry *debugfs;
+
+	/* Guards the bitmaps and the inode store. Packed images never take it. */
+	struct mutex ezfs_lock;
+
+	uint64_t alloc_cursor; /* where EZFS_ALLOC_NEXT resumes, under ezfs_lock */
+	struct delayed_work commit_work;
+
+	/* ZSTD decompression context shared by the mount's readers, set up
+	 * the first time a zstd chunk is read.
+	 */
+	struct mutex zstd_lock;
+	void *zstd_ws;
+	ZSTD_DCtx *zstd_dctx;
+
+	/* Block ranges of deleted files, waiting for the reclaim worker to
+	 * clear them from free_data_blocks. Protected by reclaim_lock.
+	 */
+	spinlock_t reclaim_lock;
+	struct list_head reclaim_list;
+	struct delayed_work reclaim_work;
+};
+
+/* The in-core inode. i_private points at the on-disk ezfs_inode in the
+ * inode store.
+ */
+struct ezfs_inode_info {
+	struct inode vfs_inode;
+
+	/* Serializes moving the file to a new extent, or rewriting chunks of
+	 * a compressed file, against the file's page cache. remap_seq goes up
+	 * under it whenever a compressed file's chunks change.
+	 */
+	struct mutex remap_lock;
+	unsigned long remap_seq;
+	unsigned long state; /* EZFS_I_* bits */
 };
+
+#define EZFS_I_SHARED	0 /* the extent may share blocks after a reflink */
+
+static inline struct ezfs_inode_info *EZFS_I(struct inode *inode)
+{
+	return container_of(inode, struct ezfs_inode_info, vfs_inode);
+}
+#endif /* ifdef __KERNEL__ */
 #endif /* ifndef __EZFS_H__ */
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libezfs.h"
+
+/* Microbenchmarks for the ezfs allocator and directory code, run on an
+ * in-memory image through libezfs. Every run is seeded, so the same
+ * options always replay the same traces.
+ */
+
+static unsigned long iterations = 100000;
+static unsigned int seed = 1;
+static unsigned int alloc = EZFS_ALLOC_FIRST, headroom;
+static const char * const alloc_names[] = { "first", "next", "best" };
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print the mean, median and 99th percentile of n samples in ns. */
+static void report(const char *name, uint64_t *samples, unsigned long n)
+{
+	uint64_t sum = 0;
+	unsigned long i;
+
+	qsort(samples, n, sizeof(*samples), u64_cmp);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+	printf("%-28s %10.1f %10llu %10llu\n", name, (double) sum / n,
+		(unsigned long long) samples[n / 2],
+		(unsigned long long) samples[n * 99 / 100]);
+}
+
+/* A fresh, empty file system in an anonymous memory file */
+static void new_image(struct ezfs_image *img)
+{
+	int fd = memfd_create("ezfs_bench", 0);
+
+	if (fd == -1 || ftruncate(fd, (EZFS_ROOT_DATABLOCK_NUMBER +
+			EZFS_MAX_DATA_BLKS) * EZFS_BLOCK_SIZE) == -1 ||
+			ezfs_image_open_fd(img, fd, 1)) {
+		perror("Error creating the image");
+		exit(1);
+	}
+	ezfs_image_mkfs(img);
+	img->alloc = alloc;
+	img->headroom = headroom;
+}
+
+/* Allocation latency on a half full bitmap made of random runs. */
+static void bench_alloc(void)
+{
+	static const uint64_t sizes[] = { 1, 4, 16 };
+	struct ezfs_image img;
+	uint64_t *samples, t, k, run;
+	unsigned long i, n;
+	int64_t blk;
+	char name[64];
+	int s;
+
+	samples = calloc(iterations, sizeof(*samples));
+	printf("%-28s %10s %10s %10s\n", "alloc (ns)", "mean", "p50", "p99");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		new_image(&img);
+		srand(seed);
+		for (k = 1; k < img.data_blocks; k += run) {
+			run = 1 + rand() % 8;
+			if (rand() % 2)
+				continue;
+			for (t = k; t < k + run && t < img.data_blocks; t++)
+				SETBIT(img.sb->free_data_blocks, t);
+		}
+		for (i = n = 0; i < iterations; i++) {
+			t = now_ns();
+			blk = ezfs_alloc_range(&img, sizes[s]);
+			samples[n++] = now_ns() - t;
+			if (blk > 0)
+				ezfs_free_blocks(img.sb, blk, sizes[s]);
+		}
+		snprintf(name, sizeof(name), "%s fit, %llu blocks",
+			alloc_names[alloc], (unsigned long long) sizes[s]);
+		report(name, samples, n);
+		ezfs_image_close(&img);
+	}
+	free(samples);
+}
+
+static int dentry_cmp(const void *a, const void *b)
+{
+	const struct ezfs_dir_entry *x = a, *y = b;
+
+	if (!x->active || !y->active)
+		return y->active - x->active;
+	return strcmp(x->filename, y->filename);
+}
+
+/* Lookup cost against directory size, scanned and binary searched. */
+static void bench_lookup(void)
+{
+	static const int nblocks[] = { 1, 2, 4, 8 };
+	struct ezfs_dir_entry *de;
+	struct ezfs_inode *root;
+	struct ezfs_image img;
+	uint64_t *samples, t;
+	unsigned long i, n;
+	char name[64], label[64];
+	int b, e, nentries, packed;
+
+	samples = calloc(iterations, sizeof(*samples));
+	printf("%-28s %10s %10s %10s\n", "lookup (ns)", "mean", "p50", "p99");
+	for (b = 0; b < sizeof(nblocks) / sizeof(nblocks[0]); b++) {
+		new_image(&img);
+		root = ezfs_inode_get(&img, EZFS_ROOT_INODE_NUMBER);
+		nentries = nblocks[b] * EZFS_MAX_CHILDREN;
+		/* Entries only need names here, so they all point at root */
+		for (e = 0; e < nentries; e++) {
+			snprintf(name, sizeof(name), "file%05d", e * 7919 %
+				nentries);
+			if (ezfs_dir_add(&img, EZFS_ROOT_INODE_NUMBER, name,
+					EZFS_ROOT_INODE_NUMBER)) {
+				fprintf(stderr, "Error filling the directory\n");
+				exit(1);
+			}
+		}
+		for (packed = 0; packed < 2; packed++) {
+			if (packed) {
+				de = ezfs_block(&img, root->data_block_number);
+				qsort(de, nentries, sizeof(*de), dentry_cmp);
+				img.sb->flags |= EZFS_SB_PACKED;
+			}
+			srand(seed);
+			for (i = n = 0; i < iterations; i++) {
+				/* One lookup in eight misses */
+				snprintf(name, sizeof(name), "file%05d",
+					rand() % (nentries + nentries / 8));
+				t = now_ns();
+				ezfs_dir_find(&img, EZFS_ROOT_INODE_NUMBER,
+					name);
+				samples[n++] = now_ns() - t;
+			}
+			snprintf(label, sizeof(label), "%s, %d entries",
+				packed ? "sorted" : "scan", nentries);
+			report(label, samples, n);
+		}
+		ezfs_image_close(&img);
+	}
+	free(samples);
+}
+
+/* Free space left and how broken up it is */
+static void free_extents(struct ezfs_image *img, uint64_t *nfree,
+		uint64_t *extents, uint64_t *largest)
+{
+	uint64_t k, run = 0;
+
+	*nfree = *extents = *largest = 0;
+	for (k = 0; k <= img->data_blocks; k++) {
+		if (k < img->data_blocks &&
+				!IS_SET(img->sb->free_data_blocks, k)) {
+			run++;
+			continue;
+		}
+		if (run) {
+			*nfree += run;
+			(*extents)++;
+			if (run > *largest)
+				*largest = run;
+		}
+		run = 0;
+	}
+}
+
+// delete a file of the root directory by inode number
+static void delete_ino(struct ezfs_image *img, uint64_t ino)
+{
+	struct ezfs_inode *root = ezfs_inode_get(img, EZFS_ROOT_INODE_NUMBER);
+	struct ezfs_dir_entry *de = ezfs_block(img, root->data_block_number);
+	uint64_t e, n = root->nblocks * EZFS_MAX_CHILDREN;
+
+	for (e = 0; e < n; e++)
+		if (de[e].active && de[e].inode_no == ino)
+			break;
+	ezfs_file_delete(img, EZFS_ROOT_INODE_NUMBER, de[e].filename);
+}
+
+/* Fragmentation under a synthetic create/append/delete trace. Appends
+ * that can't grow in place move the file, which the module does by
+ * copying the whole extent.
+ */
+static void bench_frag(void)
+{
+	uint64_t live[EZFS_MAX_INODES], nfree, extents, largest, before;
+	unsigned long i, creates = 0, appends = 0, deletes = 0;
+	unsigned long moves = 0, nospc = 0;
+	struct ezfs_inode *di;
+	struct ezfs_image img;
+	int nlive = 0, op, f;
+	char name[64];
+	int64_t ino;
+
+	new_image(&img);
+	srand(seed);
+	for (i = 0; i < iterations; i++) {
+		op = rand() % 10;
+		if (op < 3 || !nlive) {
+			snprintf(name, sizeof(name), "f%lu", i);
+			ino = ezfs_file_create(&img, EZFS_ROOT_INODE_NUMBER,
+				name);
+			if (ino < 0) {
+				nospc++;
+				continue;
+			}
+			live[nlive++] = ino;
+			creates++;
+			continue;
+		}
+		f = rand() % nlive;
+		if (op < 8) {
+			di = ezfs_inode_get(&img, live[f]);
+			before = di->data_block_number;
+			if (ezfs_file_append(&img, live[f], 1 + rand() %
+					(4 * EZFS_BLOCK_SIZE))) {
+				nospc++;
+				continue;
+			}
+			if (before && di->data_block_number != before)
+				moves++;
+			appends++;
+			continue;
+		}
+		delete_ino(&img, live[f]);
+		live[f] = live[--nlive];
+		deletes++;
+	}
+	free_extents(&img, &nfree, &extents, &largest);
+	printf("frag: %s fit, %u%% headroom\n", alloc_names[alloc], headroom);
+	printf("frag: %lu ops, %lu creates, %lu appends, %lu deletes\n",
+		iterations, creates, appends, deletes);
+	printf("frag: %lu appends moved the file, %lu ops failed for space\n",
+		moves, nospc);
+	printf("frag: %llu free blocks in %llu extents, largest %llu (%.1f%% fragmented)\n",
+		(unsigned long long) nfree, (unsigned long long) extents,
+		(unsigned long long) largest,
+		nfree ? 100.0 * (nfree - largest) / nfree : 0.0);
+	ezfs_image_close(&img);
+}
+
+static void usage(void)
+{
+	printf("Usage: ./ezfs_bench [-n ITERATIONS] [-s SEED] [-a first|next|best] [-H HEADROOM] [alloc|lookup|frag]...\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:s:a:H:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			for (alloc = 0; alloc < 3; alloc++)
+				if (!strcmp(optarg, alloc_names[alloc]))
+					break;
+			if (alloc == 3)
+				usage();
+			break;
+		case 'H':
+			headroom = strtoul(optarg, NULL, 0);
+			if (headroom > 100)
+				usage();
+			break;
+		default:
+			usage();
+		}
+	}
+	if (!iterations)
+		usage();
+	if (optind == argc) {
+		bench_alloc();
+		bench_lookup();
+		bench_frag();
+		return 0;
+	}
+	for (i = optind; i < argc; i++) {
+		if (!strcmp(argv[i], "alloc"))
+			bench_alloc();
+		else if (!strcmp(argv[i], "lookup"))
+			bench_lookup();
+		else if (!strcmp(argv[i], "frag"))
+			bench_frag();
+		else
+			usage();
+	}
+	return 0;
+}
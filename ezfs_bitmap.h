@@ -0,0 +1,135 @@
+#ifndef __EZFS_BITMAP_H__
+#define __EZFS_BITMAP_H__
+
+/* Data block bitmap helpers, shared by myez.c and libezfs so that both
+ * allocate and free blocks the same way. Include it after ezfs.h.
+ *
+ * nbits is how many data blocks the device really has. Bits past it are
+ * set on disk, as the formatter leaves them, so they are never handed out,
+ * but they aren't worth scanning or counting either.
+ */
+
+#ifdef __KERNEL__
+#define ezfs_hweight32(w)	hweight32(w)
+#else
+#include <stdbool.h>
+#include <stdint.h>
+#define ezfs_hweight32(w)	__builtin_popcount(w)
+#endif
+
+// drop one owner of each block, freeing the ones nobody shares anymore
+static inline void ezfs_free_blocks(struct ezfs_super_block *ezfs_sb,
+		uint64_t start, uint64_t count)
+{
+	uint64_t i, k;
+
+	for (i = start; i < start + count; i++) {
+		k = EZFS_DATA_BIT(i);
+		if (ezfs_sb->block_shares[k])
+			ezfs_sb->block_shares[k]--;
+		else
+			CLEARBIT(ezfs_sb->free_data_blocks, k);
+	}
+}
+
+static inline bool ezfs_range_shared(struct ezfs_super_block *ezfs_sb,
+		uint64_t start, uint64_t count)
+{
+	uint64_t i;
+
+	for (i = start; i < start + count; i++)
+		if (ezfs_sb->block_shares[EZFS_DATA_BIT(i)])
+			return true;
+	return false;
+}
+
+static inline bool ezfs_range_free(struct ezfs_super_block *ezfs_sb,
+		uint64_t nbits, uint64_t start, uint64_t count)
+{
+	uint64_t i;
+
+	if (EZFS_DATA_BIT(start + count) > nbits)
+		return false;
+	for (i = start; i < start + count; i++)
+		if (IS_SET(ezfs_sb->free_data_blocks, EZFS_DATA_BIT(i)))
+			return false;
+	return true;
+}
+
+// mark count blocks from bit on in use
+static inline void ezfs_use_bits(struct ezfs_super_block *ezfs_sb,
+		uint64_t bit, uint64_t count)
+{
+	uint64_t i;
+
+	for (i = bit; i < bit + count; i++)
+		SETBIT(ezfs_sb->free_data_blocks, i);
+}
+
+/* Whether count more blocks can be taken and still leave reserved percent
+ * of the data blocks free.
+ */
+static inline bool ezfs_within_reserve(struct ezfs_super_block *ezfs_sb,
+		uint64_t nbits, unsigned int reserved, uint64_t count)
+{
+	uint64_t used = 0, k;
+	uint32_t word;
+
+	for (k = 0; k < nbits; k += 32) {
+		word = ezfs_sb->free_data_blocks[k / 32];
+		if (nbits - k < 32)
+			word &= (1U << (nbits - k)) - 1;
+		used += ezfs_hweight32(word);
+	}
+	return used + count + nbits * reserved / 100 <= nbits;
+}
+
+/* Find the first run of count free blocks starting in [from, to) and return
+ * its first bit, or -1. *scanned counts the bits looked at.
+ */
+static inline int64_t ezfs_find_run(struct ezfs_super_block *ezfs_sb,
+		uint64_t nbits, uint64_t from, uint64_t to, uint64_t count,
+		uint64_t *scanned)
+{
+	uint64_t i, run = 0;
+
+	for (i = from; i < nbits; i++) {
+		(*scanned)++;
+		if (IS_SET(ezfs_sb->free_data_blocks, i)) {
+			run = 0;
+			continue;
+		}
+		// the run has to start before to
+		if (++run == 1 && i >= to)
+			break;
+		if (run == count)
+			return i + 1 - count;
+	}
+	return -1;
+}
+
+// smallest run of at least count free blocks, stopping at an exact fit
+static inline int64_t ezfs_find_best_run(struct ezfs_super_block *ezfs_sb,
+		uint64_t nbits, uint64_t count, uint64_t *scanned)
+{
+	uint64_t i, run = 0, best_len = (uint64_t) -1;
+	int64_t best = -1;
+
+	for (i = 0; i <= nbits; i++) {
+		if (i < nbits && !IS_SET(ezfs_sb->free_data_blocks, i)) {
+			run++;
+			continue;
+		}
+		if (run >= count && run < best_len) {
+			best = i - run;
+			best_len = run;
+			if (run == count)
+				break;
+		}
+		run = 0;
+	}
+	*scanned += i < nbits ? i + 1 : nbits;
+	return best;
+}
+
+#endif /* ifndef __EZFS_BITMAP_H__ */
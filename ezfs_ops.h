@@ -4,7 +4,7 @@
 struct inode *ezfs_get_inode(struct super_block *sb, 
 		const struct inode *dir, unsigned long ino);
 
-static struct buffer_head *ezfs_find_entry (struct inode *dir,
+static struct ezfs_dir_entry *ezfs_find_entry(struct inode *dir,
 				const struct qstr *child,
-				struct ezfs_dir_entry **res_dir);
+				struct page **res_page);
 #endif /* ifndef __EZFS_OPS_H__ */
\ No newline at end of file
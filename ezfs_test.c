@@ -0,0 +1,834 @@
+/* KUnit tests and microbenchmarks for the module. This file is included at
+ * the end of myez.c by a `make KUNIT=1` build, so it can reach the static
+ * functions, and the suites run when myez.ko is loaded into a kernel with
+ * CONFIG_KUNIT (QEMU or UML). Results are printed as TAP to the kernel log,
+ * with the timings as diagnostic lines, e.g.
+ *	# ezfs_bench_alloc: best fit, 4 blocks: 91 ns/alloc, 180 bits scanned
+ *
+ * The allocator suite works on a superblock in memory. The fs suite formats
+ * and mounts a ram disk, /dev/ram0 unless test_dev says otherwise, so the
+ * kernel needs brd (modprobe brd rd_size=4096).
+ */
+#include <kunit/test.h>
+#include <linux/namei.h>
+#include <linux/random.h>
+
+static char *test_dev = "/dev/ram0";
+module_param(test_dev, charp, 0444);
+MODULE_PARM_DESC(test_dev, "ram disk the KUnit tests format and mount");
+
+#define EZFS_BENCH_ITERS	10000
+
+struct ezfs_alloc_test {
+	struct ezfs_sb_buffer_heads sbh;
+	struct buffer_head sb_bh;
+	struct super_block sb;
+	struct ezfs_super_block ezfs_sb;
+};
+
+static int ezfs_alloc_test_init(struct kunit *test)
+{
+	struct ezfs_alloc_test *t;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+	t->sb_bh.b_data = (char *) &t->ezfs_sb;
+	t->sbh.sb_bh = &t->sb_bh;
+	t->sbh.sb = &t->sb;
+	t->sbh.data_blocks = EZFS_MAX_DATA_BLKS;
+	t->sbh.stats = alloc_percpu(struct ezfs_stats);
+	if (!t->sbh.stats)
+		return -ENOMEM;
+	test->priv = &t->sbh;
+	return 0;
+}
+
+static void ezfs_alloc_test_exit(struct kunit *test)
+{
+	struct ezfs_sb_buffer_heads *sbh = test->priv;
+
+	free_percpu(sbh->stats);
+}
+
+static inline struct ezfs_super_block *ezfs_test_sb(struct kunit *test)
+{
+	struct ezfs_sb_buffer_heads *sbh = test->priv;
+
+	return (struct ezfs_super_block *) sbh->sb_bh->b_data;
+}
+
+// mark the data blocks [start, start + count) in use
+static void ezfs_test_fill(struct ezfs_super_block *ezfs_sb, uint64_t start,
+		uint64_t count)
+{
+	uint64_t i;
+
+	for (i = start; i < start + count; i++)
+		SETBIT(ezfs_sb->free_data_blocks, EZFS_DATA_BIT(i));
+}
+
+static void ezfs_test_alloc_first(struct kunit *test)
+{
+	struct ezfs_sb_buffer_heads *sbh = test->priv;
+	const uint64_t first = EZFS_ROOT_DATABLOCK_NUMBER;
+	uint64_t i;
+
+	// every allocation has to move on to the next free block
+	for (i = 0; i < 4; i++)
+		KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), first + i);
+
+	// the lowest hole that fits wins, smaller ones are skipped
+	ezfs_free_blocks(ezfs_test_sb(test), first + 1, 1);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2), first + 4);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), first + 1);
+
+	// a run of exactly what is left, then nothing
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, EZFS_MAX_DATA_BLKS - 6),
+			first + 6);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), (uint64_t) 0);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 0), (uint64_t) 0);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, EZFS_MAX_DATA_BLKS + 1),
+			(uint64_t) 0);
+}
+
+static void ezfs_test_alloc_next(struct kunit *test)
+{
+	struct ezfs_sb_buffer_heads *sbh = test->priv;
+	const uint64_t first = EZFS_ROOT_DATABLOCK_NUMBER;
+
+	sbh->opts.alloc = EZFS_ALLOC_NEXT;
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2), first);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), first + 2);
+
+	// freed blocks behind the cursor wait until it wraps around
+	ezfs_free_blocks(ezfs_test_sb(test), first, 2);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), first + 3);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, EZFS_MAX_DATA_BLKS - 6),
+			first + 4);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2),
+			first + EZFS_MAX_DATA_BLKS - 2);
+	KUNIT_EXPECT_EQ(test, sbh->alloc_cursor, (uint64_t) 0);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2), first);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), (uint64_t) 0);
+}
+
+static void ezfs_test_alloc_best(struct kunit *test)
+{
+	struct ezfs_sb_buffer_heads *sbh = test->priv;
+	struct ezfs_super_block *ezfs_sb = ezfs_test_sb(test);
+	const uint64_t first = EZFS_ROOT_DATABLOCK_NUMBER;
+
+	// free runs of 5, 2 and 3 blocks
+	memset(ezfs_sb->free_data_blocks, 0xff,
+			sizeof(ezfs_sb->free_data_blocks));
+	ezfs_free_blocks(ezfs_sb, first + 10, 5);
+	ezfs_free_blocks(ezfs_sb, first + 20, 2);
+	ezfs_free_blocks(ezfs_sb, first + 30, 3);
+
+	sbh->opts.alloc = EZFS_ALLOC_BEST;
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2), first + 20);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2), first + 30);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 4), first + 10);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 2), (uint64_t) 0);
+	KUNIT_EXPECT_EQ(test, ezfs_alloc_range(sbh, 1), first + 14);
+}
+
+static void ezfs_test_free_shared(struct kunit *test)
+{
+	struct ezfs_super_block *ezfs_sb = ezfs_test_sb(test);
+	const uint64_t first = EZFS_ROOT_DATABLOCK_NUMBER;
+
+	// the first block is reflinked once, so it survives one free
+	ezfs_test_fill(ezfs_sb, first, 2);
+	ezfs_sb->block_shares[0] = 1;
+	ezfs_free_blocks(ezfs_sb, first, 2);
+	KUNIT_EXPECT_TRUE(test, IS_SET(ezfs_sb->free_data_blocks, 0));
+	KUNIT_EXPECT_FALSE(test, IS_SET(ezfs_sb->free_data_blocks, 1));
+	KUNIT_EXPECT_EQ(test, ezfs_sb->block_shares[0], (uint8_t) 0);
+	ezfs_free_blocks(ezfs_sb, first, 1);
+	KUNIT_EXPECT_FALSE(test, IS_SET(ezfs_sb->free_data_blocks, 0));
+}
+
+/* Allocation latency for each policy on the same half full bitmap of random
+ * runs, the one ezfs_bench's alloc uses.
+ */
+static void ezfs_bench_alloc(struct kunit *test)
+{
+	static const char * const names[] = { "first", "next", "best" };
+	static const uint64_t sizes[] = { 1, 4, 16 };
+	struct ezfs_sb_buffer_heads *sbh = test->priv;
+	struct ezfs_super_block *ezfs_sb = ezfs_test_sb(test);
+	u64 k, run, start, scanned, t, ns;
+	struct ezfs_stats st;
+	struct rnd_state rnd;
+	int p, s, i;
+
+	for (p = 0; p < ARRAY_SIZE(names); p++) {
+		for (s = 0; s < ARRAY_SIZE(sizes); s++) {
+			memset(ezfs_sb, 0, sizeof(*ezfs_sb));
+			prandom_seed_state(&rnd, 1);
+			for (k = 0; k < EZFS_MAX_DATA_BLKS; k += run) {
+				run = 1 + prandom_u32_state(&rnd) % 8;
+				if (prandom_u32_state(&rnd) % 2)
+					ezfs_test_fill(ezfs_sb,
+						k + EZFS_ROOT_DATABLOCK_NUMBER,
+						min_t(u64, run,
+						      EZFS_MAX_DATA_BLKS - k));
+			}
+			sbh->opts.alloc = p;
+			sbh->alloc_cursor = 0;
+			ezfs_stats_sum(sbh, &st);
+			scanned = st.alloc_scanned;
+			ns = 0;
+			for (i = 0; i < EZFS_BENCH_ITERS; i++) {
+				t = ktime_get_ns();
+				start = ezfs_alloc_range(sbh, sizes[s]);
+				ns += ktime_get_ns() - t;
+				if (start)
+					ezfs_free_blocks(ezfs_sb, start,
+							sizes[s]);
+			}
+			ezfs_stats_sum(sbh, &st);
+			scanned = st.alloc_scanned - scanned;
+			kunit_info(test, "%s fit, %llu blocks: %llu ns/alloc, %llu bits scanned\n",
+					names[p], sizes[s],
+					ns / EZFS_BENCH_ITERS,
+					scanned / EZFS_BENCH_ITERS);
+		}
+	}
+}
+
+static struct kunit_case ezfs_alloc_test_cases[] = {
+	KUNIT_CASE(ezfs_test_alloc_first),
+	KUNIT_CASE(ezfs_test_alloc_next),
+	KUNIT_CASE(ezfs_test_alloc_best),
+	KUNIT_CASE(ezfs_test_free_shared),
+	KUNIT_CASE(ezfs_bench_alloc),
+	{}
+};
+
+static struct kunit_suite ezfs_alloc_test_suite = {
+	.name = "ezfs_alloc",
+	.init = ezfs_alloc_test_init,
+	.exit = ezfs_alloc_test_exit,
+	.test_cases = ezfs_alloc_test_cases,
+};
+
+/* The image ezfs_test_mkfs writes: a root directory of dir_blocks blocks
+ * holding nentries entries named f0000, f0001, ..., then nfiles files of
+ * one block each, filled with 'a', 'b', ..., with a free block after every
+ * file so it can grow in place once. fixup, if set, may damage each block
+ * before it is written.
+ */
+struct ezfs_test_layout {
+	unsigned int dir_blocks;
+	unsigned int nentries;
+	unsigned int nfiles;
+	bool packed;
+	void (*fixup)(uint64_t blk, void *buf);
+};
+
+struct ezfs_test_fs {
+	struct vfsmount *mnt;
+	struct super_block *sb;
+	struct ezfs_sb_buffer_heads *sbh;
+	struct inode *root;
+};
+
+static inline uint64_t ezfs_test_file_block(const struct ezfs_test_layout *l,
+		unsigned int i)
+{
+	return EZFS_ROOT_DATABLOCK_NUMBER + l->dir_blocks + 2 * i;
+}
+
+static inline void ezfs_test_name(char *buf, unsigned int i)
+{
+	snprintf(buf, EZFS_FILENAME_BUF_SIZE, "f%04u", i);
+}
+
+// what block blk of the image for l holds
+static void ezfs_test_image_block(const struct ezfs_test_layout *l,
+		uint64_t blk, void *buf)
+{
+	uint64_t dir_end = EZFS_ROOT_DATABLOCK_NUMBER + l->dir_blocks;
+	struct ezfs_super_block *ezfs_sb = buf;
+	struct ezfs_dir_entry *de = buf;
+	struct ezfs_inode *di = buf;
+	unsigned int i, k;
+
+	memset(buf, 0, EZFS_BLOCK_SIZE);
+	if (blk == EZFS_SUPERBLOCK_DATABLOCK_NUMBER) {
+		ezfs_sb->version = 1;
+		ezfs_sb->magic = EZFS_MAGIC_NUMBER;
+		ezfs_sb->flags = l->packed ? EZFS_SB_PACKED : 0;
+		for (i = 0; i <= l->nfiles; i++)
+			SETBIT(ezfs_sb->free_inodes, i);
+		ezfs_test_fill(ezfs_sb, EZFS_ROOT_DATABLOCK_NUMBER,
+				l->dir_blocks);
+		for (i = 0; i < l->nfiles; i++)
+			ezfs_test_fill(ezfs_sb, ezfs_test_file_block(l, i), 1);
+		// bits past the last block are used, as the formatter sets them
+		for (k = EZFS_MAX_DATA_BLKS;
+		     k < sizeof(ezfs_sb->free_data_blocks) * 8; k++)
+			SETBIT(ezfs_sb->free_data_blocks, k);
+	} else if (blk == EZFS_INODE_STORE_DATABLOCK_NUMBER) {
+		di->mode = S_IFDIR | 0777;
+		di->nlink = 2;
+		di->data_block_number = EZFS_ROOT_DATABLOCK_NUMBER;
+		di->nblocks = l->dir_blocks;
+		di->file_size = l->dir_blocks * EZFS_BLOCK_SIZE;
+		for (i = 0; i < l->nfiles; i++) {
+			di++;
+			di->mode = S_IFREG | 0644;
+			di->nlink = 1;
+			di->data_block_number = ezfs_test_file_block(l, i);
+			di->nblocks = 1;
+			di->file_size = EZFS_BLOCK_SIZE;
+		}
+	} else if (blk < dir_end) {
+		// sorted by name, with the free slots last, as packing wants
+		i = (blk - EZFS_ROOT_DATABLOCK_NUMBER) * EZFS_MAX_CHILDREN;
+		for (k = 0; k < EZFS_MAX_CHILDREN && i < l->nentries;
+		     k++, i++, de++) {
+			de->active = 1;
+			de->inode_no = EZFS_ROOT_INODE_NUMBER +
+				(l->nfiles ? 1 + i % l->nfiles : 0);
+			ezfs_test_name(de->filename, i);
+		}
+	} else if ((blk - dir_end) % 2 == 0 &&
+		   (blk - dir_end) / 2 < l->nfiles) {
+		memset(buf, 'a' + (blk - dir_end) / 2, EZFS_BLOCK_SIZE);
+	}
+}
+
+static int ezfs_test_write_block(struct block_device *bdev, sector_t blk,
+		const void *data)
+{
+	struct buffer_head *bh;
+
+	bh = __getblk(bdev, blk, EZFS_BLOCK_SIZE);
+	if (!bh)
+		return -ENOMEM;
+	lock_buffer(bh);
+	memcpy(bh->b_data, data, EZFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	brelse(bh);
+	return 0;
+}
+
+/* Write the image for l over the whole of test_dev's first
+ * EZFS_MAX_DATA_BLKS data blocks, so nothing from an earlier test is left.
+ */
+static int ezfs_test_mkfs(struct kunit *test, const struct ezfs_test_layout *l)
+{
+	const fmode_t mode = FMODE_READ | FMODE_WRITE | FMODE_EXCL;
+	uint64_t blk, nblks = EZFS_ROOT_DATABLOCK_NUMBER + EZFS_MAX_DATA_BLKS;
+	struct block_device *bdev;
+	void *buf;
+	int err;
+
+	buf = kunit_kzalloc(test, EZFS_BLOCK_SIZE, GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	bdev = blkdev_get_by_path(test_dev, mode, test);
+	if (IS_ERR(bdev))
+		return PTR_ERR(bdev);
+	err = -ENOSPC;
+	if (i_size_read(bdev->bd_inode) < nblks * EZFS_BLOCK_SIZE)
+		goto out;
+	err = set_blocksize(bdev, EZFS_BLOCK_SIZE);
+	for (blk = 0; blk < nblks && !err; blk++) {
+		ezfs_test_image_block(l, blk, buf);
+		if (l->fixup)
+			l->fixup(blk, buf);
+		err = ezfs_test_write_block(bdev, blk, buf);
+	}
+	if (!err)
+		err = sync_blockdev(bdev);
+	invalidate_bdev(bdev);
+out:
+	blkdev_put(bdev, mode);
+	return err;
+}
+
+static int ezfs_test_mount(struct kunit *test, const struct ezfs_test_layout *l)
+{
+	struct ezfs_test_fs *fs = test->priv;
+	struct fs_context *fc;
+	struct vfsmount *mnt;
+	int err;
+
+	err = ezfs_test_mkfs(test, l);
+	if (err) {
+		kunit_err(test, "can't format %s (%d), is brd loaded?\n",
+				test_dev, err);
+		return err;
+	}
+	// a kernel mount is torn down right away by kern_unmount
+	fc = fs_context_for_mount(&myezfs, SB_KERNMOUNT);
+	if (IS_ERR(fc))
+		return PTR_ERR(fc);
+	err = vfs_parse_fs_string(fc, "source", test_dev, strlen(test_dev));
+	mnt = err ? ERR_PTR(err) : fc_mount(fc);
+	put_fs_context(fc);
+	if (IS_ERR(mnt))
+		return PTR_ERR(mnt);
+
+	fs->mnt = mnt;
+	fs->sb = mnt->mnt_sb;
+	fs->sbh = fs->sb->s_fs_info;
+	fs->root = d_inode(mnt->mnt_root);
+	return 0;
+}
+
+static void ezfs_test_umount(struct kunit *test)
+{
+	struct ezfs_test_fs *fs = test->priv;
+
+	if (fs->mnt)
+		kern_unmount(fs->mnt);
+	fs->mnt = NULL;
+}
+
+static int ezfs_fs_test_init(struct kunit *test)
+{
+	test->priv = kunit_kzalloc(test, sizeof(struct ezfs_test_fs),
+			GFP_KERNEL);
+	return test->priv ? 0 : -ENOMEM;
+}
+
+static void ezfs_bad_magic(uint64_t blk, void *buf)
+{
+	struct ezfs_super_block *ezfs_sb = buf;
+
+	if (blk == EZFS_SUPERBLOCK_DATABLOCK_NUMBER)
+		ezfs_sb->magic++;
+}
+
+static void ezfs_bad_version(uint64_t blk, void *buf)
+{
+	struct ezfs_super_block *ezfs_sb = buf;
+
+	if (blk == EZFS_SUPERBLOCK_DATABLOCK_NUMBER)
+		ezfs_sb->version = 2;
+}
+
+static void ezfs_bad_flags(uint64_t blk, void *buf)
+{
+	struct ezfs_super_block *ezfs_sb = buf;
+
+	if (blk == EZFS_SUPERBLOCK_DATABLOCK_NUMBER)
+		ezfs_sb->flags |= 0x8000;
+}
+
+static void ezfs_bad_root(uint64_t blk, void *buf)
+{
+	struct ezfs_inode *root = buf;
+
+	if (blk == EZFS_INODE_STORE_DATABLOCK_NUMBER)
+		root->mode = S_IFREG | 0644;
+}
+
+// what an older module left in the superblock
+static void ezfs_stale_lock(uint64_t blk, void *buf)
+{
+	struct ezfs_super_block *ezfs_sb = buf;
+
+	if (blk == EZFS_SUPERBLOCK_DATABLOCK_NUMBER)
+		ezfs_sb->unused = 0xffff888000000000ULL;
+}
+
+static void ezfs_test_mount_checks(struct kunit *test)
+{
+	static void (* const bad[])(uint64_t, void *) = {
+		ezfs_bad_magic, ezfs_bad_version, ezfs_bad_flags,
+		ezfs_bad_root,
+	};
+	struct ezfs_test_layout l = { .dir_blocks = 1 };
+	struct ezfs_test_fs *fs = test->priv;
+	struct ezfs_super_block *ezfs_sb;
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bad); i++) {
+		l.fixup = bad[i];
+		KUNIT_EXPECT_EQ(test, ezfs_test_mount(test, &l), -EINVAL);
+	}
+
+	l.fixup = ezfs_stale_lock;
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	ezfs_sb = (struct ezfs_super_block *) fs->sbh->sb_bh->b_data;
+	KUNIT_EXPECT_EQ(test, ezfs_sb->unused, (uint64_t) 0);
+	KUNIT_EXPECT_FALSE(test, mutex_is_locked(&fs->sbh->ezfs_lock));
+}
+
+// ezfs_find_entry, the way ezfs_lookup calls it
+static uint64_t ezfs_test_lookup(struct ezfs_test_fs *fs, const char *name)
+{
+	struct qstr q = QSTR_INIT(name, strlen(name));
+	struct ezfs_dir_entry *de;
+	struct page *page;
+	uint64_t ino = 0;
+
+	ezfs_lock_sb(fs->sbh);
+	de = ezfs_find_entry(fs->root, &q, &page);
+	if (de) {
+		ino = de->inode_no;
+		ezfs_put_dir_page(page);
+	}
+	ezfs_unlock_sb(fs->sbh);
+	return ino;
+}
+
+static void ezfs_test_lookups(struct kunit *test,
+		const struct ezfs_test_layout *l)
+{
+	struct ezfs_test_fs *fs = test->priv;
+	char name[EZFS_FILENAME_BUF_SIZE + 8];
+	unsigned int i;
+
+	for (i = 0; i < l->nentries; i++) {
+		ezfs_test_name(name, i);
+		KUNIT_EXPECT_EQ(test, ezfs_test_lookup(fs, name),
+				(uint64_t) EZFS_ROOT_INODE_NUMBER + 1 +
+				i % l->nfiles);
+	}
+	ezfs_test_name(name, l->nentries);
+	KUNIT_EXPECT_EQ(test, ezfs_test_lookup(fs, name), (uint64_t) 0);
+	// prefixes and extensions of a name don't match it
+	KUNIT_EXPECT_EQ(test, ezfs_test_lookup(fs, "f000"), (uint64_t) 0);
+	KUNIT_EXPECT_EQ(test, ezfs_test_lookup(fs, "f00000"), (uint64_t) 0);
+	KUNIT_EXPECT_EQ(test, ezfs_test_lookup(fs, "a"), (uint64_t) 0);
+	memset(name, 'f', sizeof(name) - 1);
+	name[sizeof(name) - 1] = '\0';
+	KUNIT_EXPECT_EQ(test, ezfs_test_lookup(fs, name), (uint64_t) 0);
+}
+
+static void ezfs_test_find_entry(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = {
+		.dir_blocks = 2,
+		.nentries = 2 * EZFS_MAX_CHILDREN - 1,
+		.nfiles = 4,
+	};
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	ezfs_test_lookups(test, &l);
+}
+
+static void ezfs_test_find_entry_sorted(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = {
+		.dir_blocks = 8,
+		.nentries = 8 * EZFS_MAX_CHILDREN - 3,
+		.nfiles = 4,
+		.packed = true,
+	};
+	struct ezfs_test_fs *fs = test->priv;
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	KUNIT_EXPECT_TRUE(test, fs->sbh->packed);
+	KUNIT_EXPECT_TRUE(test, sb_rdonly(fs->sb));
+	ezfs_test_lookups(test, &l);
+}
+
+// lookup latency against directory size, scanned and binary searched
+static void ezfs_bench_find_entry(struct kunit *test)
+{
+	static const unsigned int dir_blocks[] = { 1, 4, 16, 64 };
+	struct ezfs_test_layout l = { .nfiles = 1 };
+	struct ezfs_test_fs *fs = test->priv;
+	char name[EZFS_FILENAME_BUF_SIZE];
+	u64 probes, t, ns;
+	struct ezfs_stats st;
+	struct rnd_state rnd;
+	int b, i;
+
+	for (b = 0; b < 2 * ARRAY_SIZE(dir_blocks); b++) {
+		l.dir_blocks = dir_blocks[b / 2];
+		l.nentries = l.dir_blocks * EZFS_MAX_CHILDREN;
+		l.packed = b % 2;
+		KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+
+		prandom_seed_state(&rnd, 1);
+		ezfs_stats_sum(fs->sbh, &st);
+		probes = st.lookup_probes;
+		ns = 0;
+		for (i = 0; i < EZFS_BENCH_ITERS; i++) {
+			// one lookup in eight misses
+			ezfs_test_name(name, prandom_u32_state(&rnd) %
+					(l.nentries + l.nentries / 8));
+			t = ktime_get_ns();
+			ezfs_test_lookup(fs, name);
+			ns += ktime_get_ns() - t;
+		}
+		ezfs_stats_sum(fs->sbh, &st);
+		probes = st.lookup_probes - probes;
+		kunit_info(test, "%s, %u entries: %llu ns/lookup, %llu probes\n",
+				l.packed ? "sorted" : "scan", l.nentries,
+				ns / EZFS_BENCH_ITERS,
+				probes / EZFS_BENCH_ITERS);
+		ezfs_test_umount(test);
+	}
+}
+
+// the first file has a second link, the second one none at all
+static void ezfs_odd_links(uint64_t blk, void *buf)
+{
+	struct ezfs_inode *di = buf;
+
+	if (blk == EZFS_INODE_STORE_DATABLOCK_NUMBER) {
+		di[1].nlink = 2;
+		di[2].nlink = 0;
+	}
+}
+
+static void ezfs_test_get_inode(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = {
+		.dir_blocks = 1,
+		.nfiles = 2,
+		.fixup = ezfs_odd_links,
+	};
+	struct ezfs_test_fs *fs = test->priv;
+	struct inode *inode;
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	KUNIT_EXPECT_EQ(test, fs->root->i_nlink, 2U);
+	inode = ezfs_get_inode(fs->sb, fs->root, EZFS_ROOT_INODE_NUMBER + 1);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(inode));
+	KUNIT_EXPECT_EQ(test, inode->i_nlink, 2U);
+	iput(inode);
+	// evicting it would free an inode that is still linked
+	inode = ezfs_get_inode(fs->sb, fs->root, EZFS_ROOT_INODE_NUMBER + 2);
+	KUNIT_EXPECT_EQ(test, PTR_ERR_OR_ZERO(inode), -EIO);
+}
+
+static void ezfs_test_get_block(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = {
+		.dir_blocks = 1,
+		.nfiles = 2,
+	};
+	struct ezfs_test_fs *fs = test->priv;
+	struct buffer_head bh = { .b_size = EZFS_BLOCK_SIZE };
+	struct ezfs_inode *di;
+	struct inode *inode;
+	u64 t, ns = 0;
+	int i;
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	inode = ezfs_get_inode(fs->sb, fs->root, EZFS_ROOT_INODE_NUMBER + 1);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(inode));
+	di = inode->i_private;
+
+	KUNIT_EXPECT_EQ(test, ezfs_get_block(inode, 0, &bh, 0), 0);
+	KUNIT_EXPECT_TRUE(test, buffer_mapped(&bh));
+	KUNIT_EXPECT_EQ(test, (uint64_t) bh.b_blocknr, di->data_block_number);
+
+	// past the extent reads see a hole, and writes must grow it first
+	bh.b_state = 0;
+	KUNIT_EXPECT_EQ(test, ezfs_get_block(inode, 1, &bh, 0), 0);
+	KUNIT_EXPECT_FALSE(test, buffer_mapped(&bh));
+	KUNIT_EXPECT_EQ(test, ezfs_get_block(inode, 1, &bh, 1), -ENOSPC);
+
+	// a block past EOF comes back new, so the page cache zeroes it
+	i_size_write(inode, 0);
+	KUNIT_EXPECT_EQ(test, ezfs_get_block(inode, 0, &bh, 1), 0);
+	KUNIT_EXPECT_TRUE(test, buffer_new(&bh));
+	i_size_write(inode, EZFS_BLOCK_SIZE);
+	bh.b_state = 0;
+	KUNIT_EXPECT_EQ(test, ezfs_get_block(inode, 0, &bh, 1), 0);
+	KUNIT_EXPECT_FALSE(test, buffer_new(&bh));
+
+	for (i = 0; i < EZFS_BENCH_ITERS; i++) {
+		bh.b_state = 0;
+		t = ktime_get_ns();
+		ezfs_get_block(inode, 0, &bh, 0);
+		ns += ktime_get_ns() - t;
+	}
+	kunit_info(test, "%llu ns/call\n", ns / EZFS_BENCH_ITERS);
+	iput(inode);
+}
+
+static void ezfs_test_copy_blocks(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = { .dir_blocks = 1 };
+	const unsigned long count = 64;
+	const unsigned long from = EZFS_ROOT_DATABLOCK_NUMBER + 16;
+	const unsigned long to = from + 2 * count;
+	struct ezfs_test_fs *fs = test->priv;
+	struct buffer_head *bh;
+	unsigned long i;
+	u64 t, ns = 0;
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	// a different byte in every block, on the device and not just cached
+	for (i = 0; i < count; i++) {
+		bh = sb_getblk(fs->sb, from + i);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bh);
+		lock_buffer(bh);
+		memset(bh->b_data, i, EZFS_BLOCK_SIZE);
+		set_buffer_uptodate(bh);
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		sync_dirty_buffer(bh);
+		brelse(bh);
+	}
+
+	KUNIT_ASSERT_EQ(test, ezfs_copy_blocks(fs->sb, from, to, count), 0);
+	for (i = 0; i < count; i++) {
+		bh = sb_bread(fs->sb, to + i);
+		KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bh);
+		KUNIT_EXPECT_PTR_EQ(test, memchr_inv(bh->b_data, i,
+				EZFS_BLOCK_SIZE), NULL);
+		brelse(bh);
+	}
+
+	for (i = 0; i < 16; i++) {
+		t = ktime_get_ns();
+		ezfs_copy_blocks(fs->sb, from, to, count);
+		ns += ktime_get_ns() - t;
+	}
+	kunit_info(test, "%lu blocks: %llu MB/s\n", count,
+			16 * count * EZFS_BLOCK_SIZE * 1000 / max_t(u64, ns, 1));
+}
+
+static void ezfs_test_grow_extent(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = {
+		.dir_blocks = 1,
+		.nfiles = 2,
+	};
+	struct ezfs_test_fs *fs = test->priv;
+	struct ezfs_stats st;
+	struct ezfs_inode *di;
+	struct buffer_head *bh;
+	struct inode *inode;
+	uint64_t old;
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	inode = ezfs_get_inode(fs->sb, fs->root, EZFS_ROOT_INODE_NUMBER + 1);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(inode));
+	di = inode->i_private;
+	old = di->data_block_number;
+
+	inode_lock(inode);
+	// the block after the file is free, so it grows in place
+	KUNIT_EXPECT_EQ(test, ezfs_grow_extent(inode, 2), 0);
+	KUNIT_EXPECT_EQ(test, di->data_block_number, old);
+	KUNIT_EXPECT_EQ(test, di->nblocks, (uint64_t) 2);
+
+	// the one after that is the next file's, so it has to move
+	KUNIT_EXPECT_EQ(test, ezfs_grow_extent(inode, 3), 0);
+	KUNIT_EXPECT_NE(test, di->data_block_number, old);
+	KUNIT_EXPECT_EQ(test, di->nblocks, (uint64_t) 3);
+	inode_unlock(inode);
+	ezfs_stats_sum(fs->sbh, &st);
+	KUNIT_EXPECT_EQ(test, st.blocks_relocated, (u64) 2);
+
+	bh = sb_bread(fs->sb, di->data_block_number);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bh);
+	KUNIT_EXPECT_PTR_EQ(test, memchr_inv(bh->b_data, 'a', EZFS_BLOCK_SIZE),
+			NULL);
+	brelse(bh);
+	iput(inode);
+}
+
+// stale data in the free block after the file must not show up once a
+// truncate extends the file over it
+static void ezfs_test_truncate(struct kunit *test)
+{
+	static const struct ezfs_test_layout l = {
+		.dir_blocks = 1,
+		.nentries = 1,
+		.nfiles = 2,
+	};
+	struct ezfs_test_fs *fs = test->priv;
+	struct iattr attr = { .ia_valid = ATTR_SIZE };
+	struct buffer_head *bh;
+	struct dentry *dentry;
+	struct inode *inode;
+	struct page *page;
+	char *kaddr;
+
+	KUNIT_ASSERT_EQ(test, ezfs_test_mount(test, &l), 0);
+	bh = sb_getblk(fs->sb, ezfs_test_file_block(&l, 0) + 1);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, bh);
+	lock_buffer(bh);
+	memset(bh->b_data, 'x', EZFS_BLOCK_SIZE);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	sync_dirty_buffer(bh);
+	brelse(bh);
+
+	inode_lock(fs->root);
+	dentry = lookup_one_len("f0000", fs->mnt->mnt_root, 5);
+	inode_unlock(fs->root);
+	KUNIT_ASSERT_FALSE(test, IS_ERR_OR_NULL(dentry));
+	inode = d_inode(dentry);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+
+	inode_lock(inode);
+	attr.ia_size = EZFS_BLOCK_SIZE + 100;
+	KUNIT_EXPECT_EQ(test, notify_change(dentry, &attr, NULL), 0);
+	inode_unlock(inode);
+	KUNIT_EXPECT_EQ(test, ((struct ezfs_inode *) inode->i_private)->nblocks,
+			(uint64_t) 2);
+	page = read_mapping_page(inode->i_mapping, 1, NULL);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(page));
+	kaddr = kmap(page);
+	KUNIT_EXPECT_PTR_EQ(test, memchr_inv(kaddr, 0, PAGE_SIZE), NULL);
+	kunmap(page);
+	put_page(page);
+
+	// cutting it short zeroes the rest of the last block
+	inode_lock(inode);
+	attr.ia_size = 100;
+	KUNIT_EXPECT_EQ(test, notify_change(dentry, &attr, NULL), 0);
+	inode_unlock(inode);
+	// and gives the second block back
+	KUNIT_EXPECT_EQ(test, ((struct ezfs_inode *) inode->i_private)->nblocks,
+			(uint64_t) 1);
+	page = read_mapping_page(inode->i_mapping, 0, NULL);
+	KUNIT_ASSERT_FALSE(test, IS_ERR(page));
+	kaddr = kmap(page);
+	KUNIT_EXPECT_PTR_EQ(test, memchr_inv(kaddr, 'a', 100), NULL);
+	KUNIT_EXPECT_PTR_EQ(test, memchr_inv(kaddr + 100, 0, PAGE_SIZE - 100),
+			NULL);
+	kunmap(page);
+	put_page(page);
+	dput(dentry);
+}
+
+static struct kunit_case ezfs_fs_test_cases[] = {
+	KUNIT_CASE(ezfs_test_mount_checks),
+	KUNIT_CASE(ezfs_test_find_entry),
+	KUNIT_CASE(ezfs_test_find_entry_sorted),
+	KUNIT_CASE(ezfs_bench_find_entry),
+	KUNIT_CASE(ezfs_test_get_inode),
+	KUNIT_CASE(ezfs_test_get_block),
+	KUNIT_CASE(ezfs_test_copy_blocks),
+	KUNIT_CASE(ezfs_test_grow_extent),
+	KUNIT_CASE(ezfs_test_truncate),
+	{}
+};
+
+static struct kunit_suite ezfs_fs_test_suite = {
+	.name = "ezfs_fs",
+	.init = ezfs_fs_test_init,
+	.exit = ezfs_test_umount,
+	.test_cases = ezfs_fs_test_cases,
+};
+
+/* kunit_test_suites() would add a module_init of its own, so init_ezfs
+ * runs these once the file system is registered.
+ */
+static struct kunit_suite *ezfs_test_suites[] = {
+	&ezfs_alloc_test_suite,
+	&ezfs_fs_test_suite,
+	NULL
+};
@@ -0,0 +1,134 @@
+/* Tracepoints for ezfs. They show up under events/ezfs/ in tracefs, e.g.
+ *	echo 1 > /sys/kernel/tracing/events/ezfs/enable
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ezfs
+
+#if !defined(_EZFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _EZFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(ezfs_get_block,
+	TP_PROTO(struct inode *inode, sector_t iblock, unsigned long phys,
+		int create),
+	TP_ARGS(inode, iblock, phys, create),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(sector_t, iblock)
+		__field(unsigned long, phys)
+		__field(int, create)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->iblock = iblock;
+		__entry->phys = phys;
+		__entry->create = create;
+	),
+	TP_printk("dev %d:%d ino %lu iblock %llu phys %lu create %d",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		(unsigned long long) __entry->iblock, __entry->phys,
+		__entry->create)
+);
+
+TRACE_EVENT(ezfs_alloc,
+	TP_PROTO(struct super_block *sb, u64 count, u64 start, u64 scanned),
+	TP_ARGS(sb, count, start, scanned),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, count)
+		__field(u64, start)
+		__field(u64, scanned)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->count = count;
+		__entry->start = start;
+		__entry->scanned = scanned;
+	),
+	TP_printk("dev %d:%d count %llu start %llu scanned %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->count,
+		__entry->start, __entry->scanned)
+);
+
+TRACE_EVENT(ezfs_relocate,
+	TP_PROTO(struct inode *inode, u64 from, u64 to, u64 count),
+	TP_ARGS(inode, from, to, count),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(u64, from)
+		__field(u64, to)
+		__field(u64, count)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->from = from;
+		__entry->to = to;
+		__entry->count = count;
+	),
+	TP_printk("dev %d:%d ino %lu from %llu to %llu count %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		__entry->from, __entry->to, __entry->count)
+);
+
+TRACE_EVENT(ezfs_lookup,
+	TP_PROTO(struct inode *dir, const struct qstr *name,
+		unsigned int probes, u64 ino),
+	TP_ARGS(dir, name, probes, ino),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__string(name, name->name)
+		__field(unsigned int, probes)
+		__field(u64, ino)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__assign_str(name, name->name);
+		__entry->probes = probes;
+		__entry->ino = ino;
+	),
+	TP_printk("dev %d:%d dir %lu name %s probes %u ino %llu",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		__get_str(name), __entry->probes, __entry->ino)
+);
+
+DECLARE_EVENT_CLASS(ezfs_lock_class,
+	TP_PROTO(struct super_block *sb, u64 ns),
+	TP_ARGS(sb, ns),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(u64, ns)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ns = ns;
+	),
+	TP_printk("dev %d:%d %llu ns", MAJOR(__entry->dev),
+		MINOR(__entry->dev), __entry->ns)
+);
+
+// time spent waiting for ezfs_lock
+DEFINE_EVENT(ezfs_lock_class, ezfs_lock_acquired,
+	TP_PROTO(struct super_block *sb, u64 ns),
+	TP_ARGS(sb, ns)
+);
+
+// time ezfs_lock was held
+DEFINE_EVENT(ezfs_lock_class, ezfs_lock_released,
+	TP_PROTO(struct super_block *sb, u64 ns),
+	TP_ARGS(sb, ns)
+);
+
+#endif /* _EZFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ezfs_trace
+#include <trace/define_trace.h>
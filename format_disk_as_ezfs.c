@@ -4,9 +4,15 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <linux/fs.h>
 
 /* These are the same on a 64-bit architecture */
 #define timespec64 timespec
@@ -20,255 +26,421 @@ void passert(int condition, char *message)
 		exit(1);
 }
 
-uint64_t get_length(char *path)
+/* A node of the directory tree being written. Nodes are numbered in
+ * breadth-first order, so the children of a directory are the consecutive
+ * nodes [first, first + count), already sorted by name. A file's contents
+ * come from path, or from data for the built-in sample files.
+ */
+struct pack_node {
+	char path[PATH_MAX];
+	char name[EZFS_FILENAME_BUF_SIZE];
+	const char *data;
+	struct stat st;
+	int first, count;
+	uint64_t block, nblocks;
+};
+
+static struct pack_node nodes[EZFS_MAX_INODES];
+static int nnodes;
+
+static int pack_node_cmp(const void *a, const void *b)
 {
-	FILE *fp;
-	uint64_t size;
+	return strcmp(((const struct pack_node *) a)->name,
+		((const struct pack_node *) b)->name);
+}
 
-	fp = fopen(path, "r");
-	if (fp == NULL) {
-		printf("error when open file!\n");
-		exit(1);
+static void pack_fail(const char *path, const char *why)
+{
+	fprintf(stderr, "%s: %s\n", path, why);
+	exit(1);
+}
+
+/* Append the regular files and directories inside nodes[n] as new nodes. */
+static void pack_scan_dir(int n)
+{
+	struct pack_node *dir = &nodes[n], *child;
+	char path[PATH_MAX];
+	struct dirent *de;
+	DIR *dp;
+
+	dp = opendir(dir->path);
+	if (!dp)
+		pack_fail(dir->path, strerror(errno));
+	dir->first = nnodes;
+	while ((de = readdir(dp))) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (nnodes == EZFS_MAX_INODES)
+			pack_fail(dir->path, "too many files for one image");
+		child = &nodes[nnodes];
+		if (snprintf(path, sizeof(path), "%s/%s", dir->path,
+				de->d_name) >= sizeof(path))
+			pack_fail(dir->path, "path too long");
+		strcpy(child->path, path);
+		if (lstat(child->path, &child->st))
+			pack_fail(child->path, strerror(errno));
+		if (!S_ISREG(child->st.st_mode) && !S_ISDIR(child->st.st_mode)) {
+			fprintf(stderr, "%s: skipped, not a file or directory\n",
+				child->path);
+			continue;
+		}
+		if (strlen(de->d_name) > EZFS_MAX_FILENAME_LENGTH)
+			pack_fail(child->path, "file name too long");
+		strcpy(child->name, de->d_name);
+		nnodes++;
 	}
-	fseek(fp, 0, SEEK_END);
-	size = ftell(fp);
-	return size;
+	closedir(dp);
+	dir->count = nnodes - dir->first;
+	qsort(&nodes[dir->first], dir->count, sizeof(nodes[0]), pack_node_cmp);
+}
+
+static void scan_tree(const char *root)
+{
+	int i;
+
+	nnodes = 1;
+	snprintf(nodes[0].path, sizeof(nodes[0].path), "%s", root);
+	if (stat(root, &nodes[0].st) || !S_ISDIR(nodes[0].st.st_mode))
+		pack_fail(root, "not a directory");
+	for (i = 0; i < nnodes; i++)
+		if (S_ISDIR(nodes[i].st.st_mode))
+			pack_scan_dir(i);
+}
+
+/* Add a node for the sample layout, owned by the first user and group on
+ * the system and stamped with the current time.
+ */
+static struct pack_node *sample_node(const char *name, mode_t mode,
+		const char *path, const char *data)
+{
+	struct pack_node *node = &nodes[nnodes++];
+	struct timespec now;
+
+	memset(node, 0, sizeof(*node));
+	strcpy(node->name, name);
+	node->data = data;
+	node->st.st_mode = mode;
+	node->st.st_uid = node->st.st_gid = 1000;
+	clock_gettime(CLOCK_REALTIME, &now);
+	node->st.st_atim = node->st.st_mtim = node->st.st_ctim = now;
+	if (data)
+		node->st.st_size = strlen(data);
+	if (path) {
+		snprintf(node->path, sizeof(node->path), "%s", path);
+		if (stat(path, &node->st) == -1)
+			pack_fail(path, strerror(errno));
+		node->st.st_mode = mode;
+		node->st.st_uid = node->st.st_gid = 1000;
+	}
+	return node;
+}
+
+/* The sample layout: root with hello.txt and subdir, which holds
+ * names.txt and the two files under ./big_files.
+ */
+static void sample_tree(void)
+{
+	nnodes = 0;
+	sample_node("/", S_IFDIR | 0777, NULL, NULL);
+	nodes[0].first = nnodes;
+	nodes[0].count = 2;
+	sample_node("hello.txt", S_IFREG | 0666, NULL, "Hello World!\n");
+	sample_node("subdir", S_IFDIR | 0777, NULL, NULL);
+	nodes[2].first = nnodes;
+	nodes[2].count = 3;
+	sample_node("big_img.jpeg", S_IFREG | 0666,
+		"./big_files/big_img.jpeg", NULL);
+	sample_node("big_txt.txt", S_IFREG | 0666,
+		"./big_files/big_txt.txt", NULL);
+	sample_node("names.txt", S_IFREG | 0666, NULL,
+		"Qishuo Wang and Ruochen Li\n");
+}
+
+/* Lay the nodes out on the device: directories first, each in as few
+ * blocks as its entries need, then the file data back to back in
+ * breadth-first, name order, so files of the same directory sit next to
+ * each other. Returns the first block past the image.
+ */
+static uint64_t layout_tree(uint64_t data_blocks)
+{
+	uint64_t next = EZFS_ROOT_DATABLOCK_NUMBER;
+	int i;
+
+	for (i = 0; i < nnodes; i++) {
+		if (!S_ISDIR(nodes[i].st.st_mode))
+			continue;
+		nodes[i].block = next;
+		nodes[i].nblocks = nodes[i].count ? (nodes[i].count +
+			EZFS_MAX_CHILDREN - 1) / EZFS_MAX_CHILDREN : 1;
+		next += nodes[i].nblocks;
+	}
+	for (i = 0; i < nnodes; i++) {
+		if (!S_ISREG(nodes[i].st.st_mode) || !nodes[i].st.st_size)
+			continue;
+		nodes[i].block = next;
+		nodes[i].nblocks = (nodes[i].st.st_size + EZFS_BLOCK_SIZE - 1) /
+			EZFS_BLOCK_SIZE;
+		next += nodes[i].nblocks;
+	}
+	if (next - EZFS_ROOT_DATABLOCK_NUMBER > data_blocks)
+		pack_fail(nodes[0].path, "tree does not fit in the data blocks");
+	return next;
 }
 
-void inode_reset(struct ezfs_inode *inode)
+/* Reader threads pull the next file off a shared counter and pread() it
+ * straight into its place in the image.
+ */
+struct reader_ctx {
+	char *img;
+	int next;
+};
+
+static void *reader_thread(void *arg)
 {
-	struct timespec current_time;
+	struct reader_ctx *ctx = arg;
+	struct pack_node *node;
+	ssize_t ret;
+	int i, in;
+
+	while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) <
+			nnodes) {
+		node = &nodes[i];
+		if (!S_ISREG(node->st.st_mode) || !node->st.st_size)
+			continue;
+		if (node->data) {
+			memcpy(ctx->img + node->block * EZFS_BLOCK_SIZE,
+				node->data, node->st.st_size);
+			continue;
+		}
+		in = open(node->path, O_RDONLY);
+		if (in == -1)
+			pack_fail(node->path, strerror(errno));
+		ret = pread(in, ctx->img + node->block * EZFS_BLOCK_SIZE,
+			node->st.st_size, 0);
+		if (ret != node->st.st_size)
+			pack_fail(node->path, "short read");
+		close(in);
+	}
+	return NULL;
+}
 
-	/* In case inode is uninitialized/previously used */
-	memset(inode, 0, sizeof(*inode));
-	memset(&current_time, 0, sizeof(current_time));
+static void read_files(char *img, int nthreads)
+{
+	struct reader_ctx ctx = { .img = img, .next = 0 };
+	pthread_t threads[nthreads];
+	int i;
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, reader_thread, &ctx))
+			break;
+	passert(i > 0, "Start reader threads");
+	while (i--)
+		pthread_join(threads[i], NULL);
+}
 
-	/* These sample files will be owned by the first user and group on the system */
-	inode->uid = 1000;
-	inode->gid = 1000;
+/* Build the superblock, inode store, directories and file data in one
+ * block aligned buffer and write it with a single pwrite(). Only the
+ * blocks in use are written; the rest of the device is left alone.
+ * Inodes and data blocks past the requested geometry stay marked as used,
+ * so they are never handed out.
+ */
+static void write_image(int fd, uint64_t flags, uint64_t ninodes,
+		uint64_t data_blocks, int nthreads)
+{
+	struct ezfs_super_block *sb;
+	struct ezfs_inode *inode;
+	struct ezfs_dir_entry *dentry;
+	uint64_t next, i;
+	size_t img_len;
+	ssize_t ret;
+	char *img;
+	int j, in;
+
+	if (nnodes > ninodes)
+		pack_fail(nodes[0].path, "tree needs more inodes");
+	next = layout_tree(data_blocks);
+
+	img_len = next * EZFS_BLOCK_SIZE;
+	img = aligned_alloc(EZFS_BLOCK_SIZE, img_len);
+	passert(img != NULL, "Allocate image buffer");
+	memset(img, 0, img_len);
+	sb = (struct ezfs_super_block *) img;
+	sb->version = 1;
+	sb->magic = EZFS_MAGIC_NUMBER;
+	sb->flags = flags;
+	for (i = 0; i < nnodes; i++)
+		SETBIT(sb->free_inodes, i);
+	for (i = ninodes; i < EZFS_MAX_INODES; i++)
+		SETBIT(sb->free_inodes, i);
+	for (i = 0; i < next - EZFS_ROOT_DATABLOCK_NUMBER; i++)
+		SETBIT(sb->free_data_blocks, i);
+	for (i = data_blocks; i < EZFS_MAX_DATA_BLKS; i++)
+		SETBIT(sb->free_data_blocks, i);
+
+	for (i = 0; i < nnodes; i++) {
+		inode = (struct ezfs_inode *) (img + EZFS_BLOCK_SIZE *
+			EZFS_INODE_STORE_DATABLOCK_NUMBER) + i;
+		inode->mode = nodes[i].st.st_mode;
+		inode->uid = nodes[i].st.st_uid;
+		inode->gid = nodes[i].st.st_gid;
+		inode->i_atime = nodes[i].st.st_atim;
+		inode->i_mtime = nodes[i].st.st_mtim;
+		inode->i_ctime = nodes[i].st.st_ctim;
+		inode->data_block_number = nodes[i].block;
+		inode->nblocks = nodes[i].nblocks;
+		if (S_ISREG(nodes[i].st.st_mode)) {
+			inode->nlink = 1;
+			inode->file_size = nodes[i].st.st_size;
+			continue;
+		}
+		inode->nlink = 2;
+		inode->file_size = nodes[i].nblocks * EZFS_BLOCK_SIZE;
+		dentry = (struct ezfs_dir_entry *) (img +
+			nodes[i].block * EZFS_BLOCK_SIZE);
+		for (j = 0; j < nodes[i].count; j++) {
+			in = nodes[i].first + j;
+			if (S_ISDIR(nodes[in].st.st_mode))
+				inode->nlink++;
+			dentry[j].active = 1;
+			dentry[j].inode_no = EZFS_ROOT_INODE_NUMBER + in;
+			strcpy(dentry[j].filename, nodes[in].name);
+		}
+	}
+	read_files(img, nthreads);
 
-	/* Current time UTC */
-	clock_gettime(CLOCK_REALTIME, &current_time);
-	inode->i_atime = inode->i_mtime = inode->i_ctime = current_time;
+	ret = pwrite(fd, img, img_len, 0);
+	passert(ret == img_len, "Write superblock, inodes and data");
+	free(img);
+	printf("Wrote %d inodes and %llu data blocks.\n", nnodes,
+		(unsigned long long) (next - EZFS_ROOT_DATABLOCK_NUMBER));
 }
 
-void dentry_reset(struct ezfs_dir_entry *dentry)
+/* Parse a size such as 4096, 64K, 16M or 2G. */
+static uint64_t parse_size(const char *arg)
 {
-	memset(dentry, 0, sizeof(*dentry));
+	char *end;
+	uint64_t size = strtoull(arg, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/* fall through */
+	case 'm': case 'M':
+		size <<= 10;
+		/* fall through */
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+	if (*end || end == arg)
+		pack_fail(arg, "invalid size");
+	return size;
+}
+
+static uint64_t device_size(int fd)
+{
+	struct stat st;
+	uint64_t size;
+
+	passert(fstat(fd, &st) == 0, "Stat the device");
+	if (S_ISBLK(st.st_mode)) {
+		passert(ioctl(fd, BLKGETSIZE64, &size) == 0,
+			"Read block device size");
+		return size;
+	}
+	return st.st_size;
+}
+
+static void usage(void)
+{
+	printf("Usage: ./format_disk_as_ezfs [-s SIZE] [-N INODES] [-j THREADS]\n"
+		"\t[-x | -d DIR | -p DIR] DEVICE_NAME.\n"
+		"  -s SIZE     size to format, the device size by default;\n"
+		"              a regular file is extended to SIZE\n"
+		"  -N INODES   number of usable inodes, at most %d\n"
+		"  -j THREADS  reader threads for -d and -p, at most %d\n"
+		"  -x          write the sample files (needs ./big_files)\n"
+		"  -d DIR      import DIR into a writable file system\n"
+		"  -p DIR      pack DIR into a read-only image\n",
+		(int) EZFS_MAX_INODES, (int) EZFS_MAX_INODES);
+	exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-	int fd;
-	ssize_t ret, len;
-	struct ezfs_super_block sb;
-	struct ezfs_inode inode;
-	struct ezfs_dir_entry dentry;
-	FILE *fp;
-
-	char *name_contents = "Qishuo Wang and Ruochen Li\n";
-	char *hello_contents = "Hello World!\n";
-	uint64_t img_size, txt_size;
-	char *img_path = "./big_files/big_img.jpeg";
-	char *txt_path = "./big_files/big_txt.txt";
-	char big_buf[409600];
-	char buf[EZFS_BLOCK_SIZE];
-	const char zeroes[EZFS_BLOCK_SIZE] = { 0 };
-
-	if (argc != 2) {
-		printf("Usage: ./format_disk_as_ezfs DEVICE_NAME.\n");
-		return -1;
+	uint64_t size = 0, ninodes = EZFS_MAX_INODES, data_blocks, flags = 0;
+	char *tree = NULL;
+	int fd, opt, ret, sample = 0;
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "s:N:j:xd:p:")) != -1) {
+		switch (opt) {
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'N':
+			ninodes = strtoull(optarg, NULL, 0);
+			if (ninodes < 1 || ninodes > EZFS_MAX_INODES)
+				usage();
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage();
+			break;
+		case 'x':
+			sample = 1;
+			break;
+		case 'p':
+			flags |= EZFS_SB_PACKED;
+			/* fall through */
+		case 'd':
+			tree = optarg;
+			break;
+		default:
+			usage();
+		}
 	}
+	if (optind != argc - 1 || (sample && tree))
+		usage();
+	/* Each file is read by one thread, and there are never more files
+	 * than inodes.
+	 */
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > EZFS_MAX_INODES)
+		nthreads = EZFS_MAX_INODES;
 
-	fd = open(argv[1], O_RDWR);
+	fd = open(argv[optind], O_RDWR | (size ? O_CREAT : 0), 0644);
 	if (fd == -1) {
 		perror("Error opening the device");
 		return -1;
 	}
-	memset(&sb, 0, sizeof(sb));
-
-	sb.version = 1;
-	sb.magic = EZFS_MAGIC_NUMBER;
+	if (!size)
+		size = device_size(fd);
+	else if (device_size(fd) < size)
+		passert(ftruncate(fd, size) == 0, "Extend the image file");
+	passert(size >= (EZFS_ROOT_DATABLOCK_NUMBER + 1) * EZFS_BLOCK_SIZE,
+		"Device holds the superblock, inodes and root directory");
+	data_blocks = size / EZFS_BLOCK_SIZE - EZFS_ROOT_DATABLOCK_NUMBER;
+	if (data_blocks > EZFS_MAX_DATA_BLKS)
+		data_blocks = EZFS_MAX_DATA_BLKS;
+
+	if (tree) {
+		scan_tree(tree);
+	} else if (sample) {
+		sample_tree();
+	} else {
+		nnodes = 0;
+		sample_node("/", S_IFDIR | 0777, NULL, NULL);
+	}
+	write_image(fd, flags, ninodes, data_blocks, nthreads);
 
-	/* The first two inodes and datablocks are taken by the root and
-	 * hello.txt file, respectively. Mark them as such.
-	 */
-	// set up inode for root, hello.txt, subdir, names.txt, big_img and big_txt
-	for (int i = 0; i <= 5; i++)
-		SETBIT(sb.free_inodes, i);
-
-	SETBIT(sb.free_data_blocks, 0); // root
-	SETBIT(sb.free_data_blocks, 1); // hello
-	SETBIT(sb.free_data_blocks, 2); // subdir
-	for (int i = 3; i <= 13; i++)
-		SETBIT(sb.free_data_blocks, i);
-
-	img_size = get_length(img_path);
-	txt_size = get_length(txt_path);
-
-	/* Write the superblock to the first block of the filesystem. */
-	ret = write(fd, (char *)&sb, sizeof(sb));
-	passert(ret == EZFS_BLOCK_SIZE, "Write superblock");
-
-	inode_reset(&inode);
-	inode.mode = S_IFDIR | 0777;
-	inode.nlink = 3; // add 1 to 2 because add another directory
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER;
-	inode.file_size = EZFS_BLOCK_SIZE;
-	inode.nblocks = 1;
-
-	/* Write the root inode starting in the second block. */
-	ret = write(fd, (char *)&inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write root inode");
-
-	/* Write hello.txt inode */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 1;
-	inode.file_size = strlen(hello_contents);
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write hello.txt inode");
-	/* Write subdir inode */
-	inode_reset(&inode);
-	inode.nlink = 2;
-	inode.mode = S_IFDIR | 0777;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 2;
-	inode.file_size = EZFS_BLOCK_SIZE;
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write subdir inode");
-
-	/* Write names.txt inode */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 3;
-	inode.file_size = strlen(name_contents);
-	inode.nblocks = 1;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write names.txt inode");
-
-	/* Write big_img.jpeg inode */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 4;
-	inode.file_size = img_size;
-	inode.nblocks = 8;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write big_img.jpeg inode");
-
-	/* Write big_txt.txt inode */
-	inode_reset(&inode);
-	inode.nlink = 1;
-	inode.mode = S_IFREG | 0666;
-	inode.data_block_number = EZFS_ROOT_DATABLOCK_NUMBER + 12;
-	inode.file_size = txt_size;
-	inode.nblocks = 2;
-
-	ret = write(fd, (char *) &inode, sizeof(inode));
-	passert(ret == sizeof(inode), "Write big_txt.txt inode");
-
-	/* lseek to the next data block */
-	ret = lseek(fd, EZFS_BLOCK_SIZE - 6 * sizeof(struct ezfs_inode),
-		SEEK_CUR);
-	passert(ret >= 0, "Seek past inode table");
-	// dentry for root
-	/* dentry for hello.txt */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "hello.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 1;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for hello.txt");
-
-	/* dentry for subdir */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "subdir", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 2;
-
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for subdir");
-	/* lseek to the next data block */
-	len = EZFS_BLOCK_SIZE - 2 * sizeof(struct ezfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of root dentries");
-	/* write hello.txt content */
-	len = strlen(hello_contents);
-	strncpy(buf, hello_contents, len);
-	ret = write(fd, buf, len);
-	passert(ret == len, "Write hello.txt contents");
-	//
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len, SEEK_CUR);
-	passert(ret >= 0, "Pad to end of hello.txt data block");
-	// dentry for subdir
-	/* dentry for names.txt */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "names.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 3;
-	//
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for names.txt");
-	/* dentry for big_img.jpeg */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "big_img.jpeg", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 4;
-	//
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for big_img.jpeg");
-	/* dentry for big_txt.txt */
-	dentry_reset(&dentry);
-	strncpy(dentry.filename, "big_txt.txt", sizeof(dentry.filename));
-	dentry.active = 1;
-	dentry.inode_no = EZFS_ROOT_INODE_NUMBER + 5;
-	//
-	ret = write(fd, (char *) &dentry, sizeof(dentry));
-	passert(ret == sizeof(dentry), "Write dentry for subdir");
-	/* lseek to the next data block */
-	len = EZFS_BLOCK_SIZE - 3 * sizeof(struct ezfs_dir_entry);
-	ret = write(fd, zeroes, len);
-	passert(ret == len, "Pad to end of subdir dentries");
-	// write names.txt content
-	len = strlen(name_contents);
-	strncpy(buf, name_contents, len);
-	ret = write(fd, buf, len);
-	passert(ret == len, "Write names.txt contents");
-	//
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len, SEEK_CUR);
-	passert(ret >= 0, "Pad to end of names.txt data block");
-	// write big_img.jpeg content
-	fp = fopen(img_path, "r");
-	fread(&big_buf, img_size, 1, fp);
-	fclose(fp);
-	len = img_size;
-	ret = write(fd, big_buf, len);
-	passert(ret == len, "Write big_img.jpeg contents");
-	//
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len % EZFS_BLOCK_SIZE, SEEK_CUR);
-	passert(ret >= 0, "Pad to end of big_img data block");
-	// write big_txt.txt content
-	fp = fopen(txt_path, "r");
-	fread(&big_buf, txt_size, 1, fp);
-	fclose(fp);
-	len = txt_size;
-	ret = write(fd, big_buf, len);
-	passert(ret == len, "Write big_txt.txt contents");
-	ret = lseek(fd, EZFS_BLOCK_SIZE - len % EZFS_BLOCK_SIZE, SEEK_CUR);
-	passert(ret >= 0, "Pad to end of big_txt data block");
 	ret = fsync(fd);
 	passert(ret == 0, "Flush writes to disk");
 	close(fd);
-	printf("Device [%s] formatted successfully.\n", argv[1]);
+	printf("Device [%s] formatted successfully.\n", argv[optind]);
 
 	return 0;
 }
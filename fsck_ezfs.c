@@ -0,0 +1,506 @@
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/fs.h>
+
+/* These are the same on a 64-bit architecture */
+#define timespec64 timespec
+
+#include "ezfs.h"
+
+/* Exit codes, as fsck(8) defines them */
+#define FSCK_OK		0
+#define FSCK_FIXED	1
+#define FSCK_UNFIXED	4
+#define FSCK_ERROR	8
+
+static struct ezfs_super_block *sb;
+static struct ezfs_inode *inodes;
+static uint64_t data_blocks; /* data blocks that fit on the device */
+static int repair;
+static int errors, fixed;
+
+/* What the scan found out about each inode and data block */
+static uint8_t bad[EZFS_MAX_INODES];     /* unusable, must be cleared */
+static uint8_t reached[EZFS_MAX_INODES]; /* found from the root */
+static unsigned int links[EZFS_MAX_INODES];
+static unsigned int subdirs[EZFS_MAX_INODES];
+static unsigned int owners[EZFS_MAX_DATA_BLKS];
+
+/* Report a problem. Returns whether it should be repaired. */
+static int problem(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static int problem(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf(repair ? " (fixed)\n" : "\n");
+	__atomic_fetch_add(repair ? &fixed : &errors, 1, __ATOMIC_RELAXED);
+	return repair;
+}
+
+static int inode_in_use(int i)
+{
+	return inodes[i].mode != 0;
+}
+
+/* Pass 1: check every inode on its own. Threads each take a slice of the
+ * inode table; nothing here depends on another inode.
+ */
+struct scan_slice {
+	int start, end;
+};
+
+static void *scan_inodes(void *arg)
+{
+	struct scan_slice *slice = arg;
+	struct ezfs_inode *di;
+	uint64_t first, last;
+	int i;
+
+	for (i = slice->start; i < slice->end; i++) {
+		di = &inodes[i];
+		if (!inode_in_use(i))
+			continue;
+		if (!S_ISDIR(di->mode) && !S_ISREG(di->mode)) {
+			problem("inode %d: bad mode %o", i + 1, di->mode);
+			bad[i] = 1;
+			continue;
+		}
+		first = di->data_block_number;
+		last = first + di->nblocks;
+		if (di->nblocks && (first < EZFS_ROOT_DATABLOCK_NUMBER ||
+				last > EZFS_ROOT_DATABLOCK_NUMBER + data_blocks ||
+				last < first)) {
+			problem("inode %d: blocks %llu-%llu outside the device",
+				i + 1, (unsigned long long) first,
+				(unsigned long long) last - 1);
+			bad[i] = 1;
+			continue;
+		}
+		if (S_ISDIR(di->mode) && !di->nblocks) {
+			problem("inode %d: directory without blocks", i + 1);
+			bad[i] = 1;
+			continue;
+		}
+		if (S_ISDIR(di->mode) &&
+				di->file_size != di->nblocks * EZFS_BLOCK_SIZE) {
+			if (problem("inode %d: directory size %llu", i + 1,
+					(unsigned long long) di->file_size))
+				di->file_size = di->nblocks * EZFS_BLOCK_SIZE;
+		}
+		if (S_ISREG(di->mode) && !(di->flags & EZFS_INODE_COMPR_MASK) &&
+				di->file_size > di->nblocks * EZFS_BLOCK_SIZE) {
+			if (problem("inode %d: size %llu past its %llu blocks",
+					i + 1, (unsigned long long) di->file_size,
+					(unsigned long long) di->nblocks))
+				di->file_size = di->nblocks * EZFS_BLOCK_SIZE;
+		}
+	}
+	return NULL;
+}
+
+static void scan_inode_table(int nthreads)
+{
+	struct scan_slice slices[nthreads];
+	pthread_t threads[nthreads];
+	int i, per, started;
+
+	per = (EZFS_MAX_INODES + nthreads - 1) / nthreads;
+	for (started = 0; started < nthreads; started++) {
+		slices[started].start = started * per;
+		slices[started].end = slices[started].start + per;
+		if (slices[started].end > EZFS_MAX_INODES)
+			slices[started].end = EZFS_MAX_INODES;
+		if (pthread_create(&threads[started], NULL, scan_inodes,
+				&slices[started]))
+			break;
+	}
+	/* Whatever could not get a thread is scanned here */
+	if (started < nthreads) {
+		slices[started].end = EZFS_MAX_INODES;
+		scan_inodes(&slices[started]);
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static int dentry_cmp(const void *a, const void *b)
+{
+	const struct ezfs_dir_entry *x = a, *y = b;
+
+	if (!x->active || !y->active)
+		return y->active - x->active;
+	return strcmp(x->filename, y->filename);
+}
+
+/* Check one directory's entries and queue the directories it holds. */
+static void check_dir(int dir, int *queue, int *tail)
+{
+	struct ezfs_inode *di = &inodes[dir];
+	struct ezfs_dir_entry *de, *other;
+	uint64_t nentries, i, j;
+	int child, sorted = 1;
+	char *dblock;
+
+	dblock = (char *) sb + di->data_block_number * EZFS_BLOCK_SIZE;
+	de = (struct ezfs_dir_entry *) dblock;
+	nentries = di->nblocks * EZFS_MAX_CHILDREN;
+	for (i = 0; i < nentries; i++) {
+		if (!de[i].active)
+			continue;
+		if (i && dentry_cmp(&de[i - 1], &de[i]) > 0)
+			sorted = 0;
+		child = de[i].inode_no - EZFS_ROOT_INODE_NUMBER;
+		if (!memchr(de[i].filename, 0, EZFS_FILENAME_BUF_SIZE) ||
+				!de[i].filename[0] || strchr(de[i].filename, '/')) {
+			if (problem("inode %d: entry %llu has a bad name",
+					dir + 1, (unsigned long long) i))
+				memset(&de[i], 0, sizeof(de[i]));
+			continue;
+		}
+		if (de[i].inode_no < EZFS_ROOT_INODE_NUMBER ||
+				de[i].inode_no >= EZFS_ROOT_INODE_NUMBER +
+				EZFS_MAX_INODES || !inode_in_use(child) ||
+				bad[child]) {
+			if (problem("inode %d: entry '%s' points to unused inode %llu",
+					dir + 1, de[i].filename,
+					(unsigned long long) de[i].inode_no))
+				memset(&de[i], 0, sizeof(de[i]));
+			continue;
+		}
+		for (j = 0, other = de; j < i; j++, other++)
+			if (other->active &&
+					!strcmp(other->filename, de[i].filename))
+				break;
+		if (j < i) {
+			if (problem("inode %d: duplicate entry '%s'", dir + 1,
+					de[i].filename))
+				memset(&de[i], 0, sizeof(de[i]));
+			continue;
+		}
+		if (S_ISDIR(inodes[child].mode) && reached[child]) {
+			if (problem("inode %d: second link '%s' to directory %d",
+					dir + 1, de[i].filename, child + 1))
+				memset(&de[i], 0, sizeof(de[i]));
+			continue;
+		}
+		links[child]++;
+		if (S_ISDIR(inodes[child].mode))
+			subdirs[dir]++;
+		if (!reached[child]) {
+			reached[child] = 1;
+			if (S_ISDIR(inodes[child].mode))
+				queue[(*tail)++] = child;
+		}
+	}
+
+	/* Packed directories are binary searched, so order matters */
+	if (!(sb->flags & EZFS_SB_PACKED))
+		return;
+	for (i = 1; sorted && i < nentries; i++)
+		if (!de[i - 1].active && de[i].active)
+			sorted = 0;
+	if (!sorted && problem("inode %d: packed directory is not sorted",
+			dir + 1))
+		qsort(de, nentries, sizeof(*de), dentry_cmp);
+}
+
+/* Pass 2: walk the tree from the root, breadth first. */
+static void walk_tree(void)
+{
+	int queue[EZFS_MAX_INODES];
+	int head = 0, tail = 0;
+
+	reached[0] = 1;
+	queue[tail++] = 0;
+	while (head < tail)
+		check_dir(queue[head++], queue, &tail);
+}
+
+/* Pass 3: link counts, and inodes nothing points to */
+static void check_links(void)
+{
+	unsigned int want;
+	int i;
+
+	for (i = 0; i < EZFS_MAX_INODES; i++) {
+		if (!inode_in_use(i))
+			continue;
+		if (!reached[i]) {
+			if (problem("inode %d: not linked from any directory",
+					i + 1))
+				memset(&inodes[i], 0, sizeof(inodes[i]));
+			continue;
+		}
+		want = S_ISDIR(inodes[i].mode) ? 2 + subdirs[i] : links[i];
+		if (inodes[i].nlink != want &&
+				problem("inode %d: link count %u, should be %u",
+					i + 1, inodes[i].nlink, want))
+			inodes[i].nlink = want;
+	}
+}
+
+/* First block of a run of count data blocks no inode owns, or 0 */
+static uint64_t find_unowned(uint64_t count)
+{
+	uint64_t k, run = 0;
+
+	for (k = 0; k < data_blocks; k++) {
+		run = owners[k] ? 0 : run + 1;
+		if (run == count)
+			return k + 1 - count + EZFS_ROOT_DATABLOCK_NUMBER;
+	}
+	return 0;
+}
+
+static void own_blocks(int i, int delta)
+{
+	uint64_t b;
+
+	for (b = 0; b < inodes[i].nblocks; b++)
+		owners[EZFS_DATA_BIT(inodes[i].data_block_number + b)] += delta;
+}
+
+/* Files only share blocks that block_shares says are shared. Any further
+ * owner is cross-linked: it gets a copy of the data if there is room, or a
+ * regular file loses its data. block_shares itself is never raised to
+ * make a cross-link look like a reflink.
+ */
+static void check_cross_links(void)
+{
+	unsigned int claimed[EZFS_MAX_DATA_BLKS] = { 0 };
+	uint64_t b, k, first, n, to;
+	char *base = (char *) sb;
+	int i, crossed;
+
+	for (i = 0; i < EZFS_MAX_INODES; i++) {
+		if (!reached[i] || !inodes[i].nblocks)
+			continue;
+		first = inodes[i].data_block_number;
+		n = inodes[i].nblocks;
+		crossed = 0;
+		for (b = 0; b < n; b++) {
+			k = EZFS_DATA_BIT(first + b);
+			if (claimed[k] > sb->block_shares[k])
+				crossed = 1;
+		}
+		to = crossed ? find_unowned(n) : 0;
+		if (crossed && !to && !S_ISREG(inodes[i].mode)) {
+			printf("inode %d: blocks %llu-%llu are cross-linked, no room for a copy\n",
+				i + 1, (unsigned long long) first,
+				(unsigned long long) first + n - 1);
+			errors++;
+		} else if (crossed &&
+				problem("inode %d: blocks %llu-%llu are cross-linked%s",
+					i + 1, (unsigned long long) first,
+					(unsigned long long) first + n - 1,
+					to ? "" : ", clearing its data")) {
+			own_blocks(i, -1);
+			if (!to) {
+				inodes[i].data_block_number = 0;
+				inodes[i].nblocks = 0;
+				inodes[i].file_size = 0;
+				continue;
+			}
+			memcpy(base + to * EZFS_BLOCK_SIZE,
+				base + first * EZFS_BLOCK_SIZE,
+				n * EZFS_BLOCK_SIZE);
+			inodes[i].data_block_number = to;
+			own_blocks(i, 1);
+		}
+		for (b = 0; b < n; b++)
+			claimed[EZFS_DATA_BIT(inodes[i].data_block_number + b)]++;
+	}
+}
+
+/* Pass 4: rebuild free_inodes, free_data_blocks and block_shares from the
+ * inodes reached from the root, and compare them with what is on disk.
+ */
+static void check_bitmaps(void)
+{
+	DECLARE_BIT_VECTOR(want_inodes, EZFS_MAX_INODES);
+	DECLARE_BIT_VECTOR(want_blocks, EZFS_MAX_DATA_BLKS);
+	uint8_t want_shares[EZFS_MAX_DATA_BLKS];
+	int leaked = 0, lost = 0, shares = 0;
+	uint64_t k;
+	int i, reserved;
+
+	memset(want_inodes, 0, sizeof(want_inodes));
+	memset(want_blocks, 0, sizeof(want_blocks));
+	memset(owners, 0, sizeof(owners));
+
+	/* A run of unused inodes marked in use up to the end of the table
+	 * is what format_disk_as_ezfs -N leaves behind; keep it.
+	 */
+	for (reserved = EZFS_MAX_INODES; reserved > 0; reserved--)
+		if (!IS_SET(sb->free_inodes, reserved - 1) ||
+				inode_in_use(reserved - 1))
+			break;
+	for (i = 0; i < EZFS_MAX_INODES; i++) {
+		if (i >= reserved || reached[i])
+			SETBIT(want_inodes, i);
+		if (reached[i])
+			own_blocks(i, 1);
+	}
+	check_cross_links();
+	for (k = 0; k < EZFS_MAX_DATA_BLKS; k++) {
+		if (k >= data_blocks || owners[k])
+			SETBIT(want_blocks, k);
+		/* share counts may only come down, a cross-link is no reflink */
+		want_shares[k] = owners[k] > 1 ? owners[k] - 1 : 0;
+		if (want_shares[k] > sb->block_shares[k])
+			want_shares[k] = sb->block_shares[k];
+		if (IS_SET(want_blocks, k) && !IS_SET(sb->free_data_blocks, k))
+			lost++;
+		else if (!IS_SET(want_blocks, k) &&
+				IS_SET(sb->free_data_blocks, k))
+			leaked++;
+		if (want_shares[k] != sb->block_shares[k])
+			shares++;
+	}
+
+	for (i = 0; i < EZFS_MAX_INODES; i++)
+		if (!!IS_SET(want_inodes, i) != !!IS_SET(sb->free_inodes, i))
+			break;
+	if (i < EZFS_MAX_INODES && problem("inode bitmap is wrong"))
+		memcpy(sb->free_inodes, want_inodes, sizeof(want_inodes));
+	if (lost && problem("%d blocks in use are marked free", lost))
+		memcpy(sb->free_data_blocks, want_blocks, sizeof(want_blocks));
+	if (leaked && problem("%d free blocks are marked in use", leaked))
+		memcpy(sb->free_data_blocks, want_blocks, sizeof(want_blocks));
+	if (shares && problem("%d blocks have the wrong share count", shares))
+		memcpy(sb->block_shares, want_shares, sizeof(want_shares));
+}
+
+static void usage(void)
+{
+	printf("Usage: ./fsck.ezfs [-n | -y] [-j THREADS] DEVICE_NAME.\n"
+		"  -n          only report problems (default)\n"
+		"  -y          repair every problem found\n"
+		"  -j THREADS  threads scanning the inode table\n");
+	exit(FSCK_ERROR);
+}
+
+int main(int argc, char *argv[])
+{
+	int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	int fd, opt;
+	uint64_t size;
+	struct stat st;
+	size_t map_len;
+
+	while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+		switch (opt) {
+		case 'n':
+			repair = 0;
+			break;
+		case 'y':
+			repair = 1;
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - 1)
+		usage();
+	if (nthreads < 1)
+		nthreads = 1;
+	if (nthreads > EZFS_MAX_INODES)
+		nthreads = EZFS_MAX_INODES;
+
+	/* Repairing a mounted file system would corrupt it, so a block device
+	 * is opened exclusively and left alone if the kernel is using it.
+	 */
+	if (stat(argv[optind], &st) == -1) {
+		perror("Error opening the device");
+		return FSCK_ERROR;
+	}
+	fd = open(argv[optind], repair ? O_RDWR |
+		(S_ISBLK(st.st_mode) ? O_EXCL : 0) : O_RDONLY);
+	if (fd == -1 && errno == EBUSY) {
+		fprintf(stderr, "%s is in use, not repairing it\n",
+			argv[optind]);
+		return FSCK_ERROR;
+	}
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror("Error opening the device");
+		return FSCK_ERROR;
+	}
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+		perror("Error reading the device size");
+		return FSCK_ERROR;
+	}
+	if (size < (EZFS_ROOT_DATABLOCK_NUMBER + 1) * EZFS_BLOCK_SIZE) {
+		fprintf(stderr, "%s: too small for ezfs\n", argv[optind]);
+		return FSCK_ERROR;
+	}
+	data_blocks = size / EZFS_BLOCK_SIZE - EZFS_ROOT_DATABLOCK_NUMBER;
+	if (data_blocks > EZFS_MAX_DATA_BLKS)
+		data_blocks = EZFS_MAX_DATA_BLKS;
+
+	/* Only the metadata and data blocks ezfs can address are mapped */
+	map_len = (EZFS_ROOT_DATABLOCK_NUMBER + data_blocks) * EZFS_BLOCK_SIZE;
+	sb = mmap(NULL, map_len, PROT_READ | (repair ? PROT_WRITE : 0),
+		repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	if (sb == MAP_FAILED) {
+		perror("Error mapping the device");
+		return FSCK_ERROR;
+	}
+	inodes = (struct ezfs_inode *) ((char *) sb +
+		EZFS_INODE_STORE_DATABLOCK_NUMBER * EZFS_BLOCK_SIZE);
+
+	if (sb->magic != EZFS_MAGIC_NUMBER) {
+		fprintf(stderr, "%s: no ezfs superblock\n", argv[optind]);
+		return FSCK_ERROR;
+	}
+	/* Repairs made without knowing the format would do more harm */
+	if (sb->version != 1 || (sb->flags & ~EZFS_SB_PACKED)) {
+		fprintf(stderr, "%s: unsupported version %llu or flags %#llx\n",
+			argv[optind], (unsigned long long) sb->version,
+			(unsigned long long) sb->flags);
+		return FSCK_ERROR;
+	}
+	/* Older modules wrote a kernel pointer there */
+	if (sb->unused && problem("Superblock holds a stale lock pointer"))
+		sb->unused = 0;
+	scan_inode_table(nthreads);
+	if (!inode_in_use(0) || bad[0] || !S_ISDIR(inodes[0].mode)) {
+		fprintf(stderr, "%s: root directory is damaged\n",
+			argv[optind]);
+		return FSCK_UNFIXED;
+	}
+	walk_tree();
+	check_links();
+	check_bitmaps();
+
+	if (repair && msync(sb, map_len, MS_SYNC) == -1) {
+		perror("Error writing the repairs");
+		return FSCK_ERROR;
+	}
+	munmap(sb, map_len);
+	close(fd);
+
+	printf("%s: %d problems found, %d fixed.\n", argv[optind],
+		errors + fixed, fixed);
+	if (errors)
+		return FSCK_UNFIXED;
+	return fixed ? FSCK_FIXED : FSCK_OK;
+}
@@ -0,0 +1,383 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "libezfs.h"
+
+int ezfs_image_open_fd(struct ezfs_image *img, int fd, int writable)
+{
+	struct stat st;
+	uint64_t size;
+
+	memset(img, 0, sizeof(*img));
+	if (fstat(fd, &st) == -1)
+		return -errno;
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1)
+		return -errno;
+	if (size < (EZFS_ROOT_DATABLOCK_NUMBER + 1) * EZFS_BLOCK_SIZE)
+		return -EINVAL;
+	img->data_blocks = size / EZFS_BLOCK_SIZE - EZFS_ROOT_DATABLOCK_NUMBER;
+	if (img->data_blocks > EZFS_MAX_DATA_BLKS)
+		img->data_blocks = EZFS_MAX_DATA_BLKS;
+
+	img->fd = fd;
+	img->len = (EZFS_ROOT_DATABLOCK_NUMBER + img->data_blocks) *
+		EZFS_BLOCK_SIZE;
+	img->base = mmap(NULL, img->len, PROT_READ | (writable ? PROT_WRITE : 0),
+		MAP_SHARED, fd, 0);
+	if (img->base == MAP_FAILED)
+		return -errno;
+	img->sb = (struct ezfs_super_block *) img->base;
+	img->inodes = ezfs_block(img, EZFS_INODE_STORE_DATABLOCK_NUMBER);
+	return 0;
+}
+
+int ezfs_image_open(struct ezfs_image *img, const char *path, int writable)
+{
+	int fd, err;
+
+	fd = open(path, writable ? O_RDWR : O_RDONLY);
+	if (fd == -1)
+		return -errno;
+	err = ezfs_image_open_fd(img, fd, writable);
+	if (err) {
+		close(fd);
+		return err;
+	}
+	if (img->sb->magic != EZFS_MAGIC_NUMBER) {
+		ezfs_image_close(img);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Write an empty file system: the superblock and a root directory with one
+ * block. Blocks past the end of the device are marked as used, as
+ * format_disk_as_ezfs does.
+ */
+void ezfs_image_mkfs(struct ezfs_image *img)
+{
+	struct ezfs_inode *root;
+	struct timespec now;
+	uint64_t k;
+
+	memset(img->base, 0, (EZFS_ROOT_DATABLOCK_NUMBER + 1) *
+		EZFS_BLOCK_SIZE);
+	img->sb->version = 1;
+	img->sb->magic = EZFS_MAGIC_NUMBER;
+	for (k = img->data_blocks; k < EZFS_MAX_DATA_BLKS; k++)
+		SETBIT(img->sb->free_data_blocks, k);
+
+	SETBIT(img->sb->free_inodes, EZFS_INODE_BIT(EZFS_ROOT_INODE_NUMBER));
+	SETBIT(img->sb->free_data_blocks,
+		EZFS_DATA_BIT(EZFS_ROOT_DATABLOCK_NUMBER));
+	root = ezfs_inode_get(img, EZFS_ROOT_INODE_NUMBER);
+	root->mode = S_IFDIR | 0777;
+	root->nlink = 2;
+	root->data_block_number = EZFS_ROOT_DATABLOCK_NUMBER;
+	root->nblocks = 1;
+	root->file_size = EZFS_BLOCK_SIZE;
+	clock_gettime(CLOCK_REALTIME, &now);
+	root->i_atime = root->i_mtime = root->i_ctime = now;
+}
+
+int ezfs_image_sync(struct ezfs_image *img)
+{
+	return msync(img->base, img->len, MS_SYNC) ? -errno : 0;
+}
+
+void ezfs_image_close(struct ezfs_image *img)
+{
+	munmap(img->base, img->len);
+	close(img->fd);
+	img->base = NULL;
+}
+
+void *ezfs_block(struct ezfs_image *img, uint64_t blk)
+{
+	return img->base + blk * EZFS_BLOCK_SIZE;
+}
+
+struct ezfs_inode *ezfs_inode_get(struct ezfs_image *img, uint64_t ino)
+{
+	if (ino < EZFS_ROOT_INODE_NUMBER || EZFS_INODE_BIT(ino) >= EZFS_MAX_INODES)
+		return NULL;
+	return &img->inodes[EZFS_INODE_BIT(ino)];
+}
+
+int64_t ezfs_alloc_inode(struct ezfs_image *img)
+{
+	uint64_t i;
+
+	if (img->sb->flags & EZFS_SB_PACKED)
+		return -EROFS;
+	for (i = 0; i < EZFS_MAX_INODES; i++) {
+		if (IS_SET(img->sb->free_inodes, i))
+			continue;
+		SETBIT(img->sb->free_inodes, i);
+		memset(&img->inodes[i], 0, sizeof(img->inodes[i]));
+		return i + EZFS_ROOT_INODE_NUMBER;
+	}
+	return -ENOSPC;
+}
+
+void ezfs_free_inode(struct ezfs_image *img, uint64_t ino)
+{
+	memset(ezfs_inode_get(img, ino), 0, sizeof(struct ezfs_inode));
+	CLEARBIT(img->sb->free_inodes, EZFS_INODE_BIT(ino));
+}
+
+/* The module's ezfs_alloc_range: count contiguous free data blocks, picked
+ * with img->alloc and marked in use. Returns the first block.
+ */
+int64_t ezfs_alloc_range(struct ezfs_image *img, uint64_t count)
+{
+	uint64_t scanned = 0;
+	int64_t bit;
+
+	if (img->sb->flags & EZFS_SB_PACKED)
+		return -EROFS;
+	if (!count)
+		return -EINVAL;
+	if (!ezfs_within_reserve(img->sb, img->data_blocks, img->reserved,
+			count))
+		return -ENOSPC;
+	switch (img->alloc) {
+	case EZFS_ALLOC_NEXT:
+		bit = ezfs_find_run(img->sb, img->data_blocks,
+			img->alloc_cursor, img->data_blocks, count, &scanned);
+		if (bit < 0)
+			bit = ezfs_find_run(img->sb, img->data_blocks, 0,
+				img->alloc_cursor, count, &scanned);
+		break;
+	case EZFS_ALLOC_BEST:
+		bit = ezfs_find_best_run(img->sb, img->data_blocks, count,
+			&scanned);
+		break;
+	default:
+		bit = ezfs_find_run(img->sb, img->data_blocks, 0,
+			img->data_blocks, count, &scanned);
+		break;
+	}
+	if (bit < 0)
+		return -ENOSPC;
+	ezfs_use_bits(img->sb, bit, count);
+	img->alloc_cursor = (bit + count) % img->data_blocks;
+	return bit + EZFS_ROOT_DATABLOCK_NUMBER;
+}
+
+// take the blocks right behind the extent until it is count blocks long
+static int ezfs_extend_in_place(struct ezfs_image *img, struct ezfs_inode *di,
+		uint64_t count)
+{
+	uint64_t i, end = di->data_block_number + di->nblocks;
+
+	if (!ezfs_range_free(img->sb, img->data_blocks, end,
+			count - di->nblocks) ||
+	    !ezfs_within_reserve(img->sb, img->data_blocks, img->reserved,
+			count - di->nblocks))
+		return 0;
+	for (i = end; i < di->data_block_number + count; i++)
+		SETBIT(img->sb->free_data_blocks, EZFS_DATA_BIT(i));
+	return 1;
+}
+
+/* Grow ino's extent to want blocks, plus img->headroom percent of slack,
+ * the way the module's ezfs_grow_extent does: in place when the blocks
+ * after it are free, otherwise by moving the whole file to a new run.
+ */
+static int ezfs_grow(struct ezfs_image *img, uint64_t ino, uint64_t want)
+{
+	struct ezfs_inode *di = ezfs_inode_get(img, ino);
+	uint64_t slack = want * img->headroom / 100, grow;
+	int64_t start;
+
+	if (di->nblocks >= want)
+		return 0;
+	if (want > img->data_blocks)
+		return -EFBIG;
+	if (slack > img->data_blocks - want)
+		slack = img->data_blocks - want;
+	grow = want + slack;
+	if (di->data_block_number && ezfs_extend_in_place(img, di, grow))
+		goto zero;
+	grow = want;
+	if (di->data_block_number && ezfs_extend_in_place(img, di, grow))
+		goto zero;
+	grow = want + slack;
+	start = ezfs_alloc_range(img, grow);
+	if (start == -ENOSPC && slack)
+		start = ezfs_alloc_range(img, grow = want);
+	if (start < 0)
+		return start;
+	if (di->nblocks) {
+		memcpy(ezfs_block(img, start),
+			ezfs_block(img, di->data_block_number),
+			di->nblocks * EZFS_BLOCK_SIZE);
+		ezfs_free_blocks(img->sb, di->data_block_number, di->nblocks);
+	}
+	di->data_block_number = start;
+zero:
+	memset(ezfs_block(img, di->data_block_number + di->nblocks), 0,
+		(grow - di->nblocks) * EZFS_BLOCK_SIZE);
+	di->nblocks = grow;
+	return 0;
+}
+
+// strcmp() order of a name against a directory entry, as the module sorts
+static int ezfs_nameorder(const char *name, const char *buffer)
+{
+	return strncmp(name, buffer, EZFS_FILENAME_BUF_SIZE);
+}
+
+/* Packed directories are sorted with the unused slots last, so they are
+ * binary searched like the module does. Others are scanned.
+ */
+struct ezfs_dir_entry *ezfs_dir_find(struct ezfs_image *img, uint64_t dir,
+		const char *name)
+{
+	struct ezfs_inode *di = ezfs_inode_get(img, dir);
+	struct ezfs_dir_entry *de;
+	uint64_t n, lo = 0, hi, mid;
+	int cmp;
+
+	if (!di || !S_ISDIR(di->mode))
+		return NULL;
+	de = ezfs_block(img, di->data_block_number);
+	n = di->nblocks * EZFS_MAX_CHILDREN;
+	if (img->sb->flags & EZFS_SB_PACKED) {
+		hi = n;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			cmp = de[mid].active ?
+				ezfs_nameorder(name, de[mid].filename) : -1;
+			if (!cmp)
+				return &de[mid];
+			if (cmp < 0)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		return NULL;
+	}
+	for (mid = 0; mid < n; mid++)
+		if (de[mid].active && !ezfs_nameorder(name, de[mid].filename))
+			return &de[mid];
+	return NULL;
+}
+
+int ezfs_dir_add(struct ezfs_image *img, uint64_t dir, const char *name,
+		uint64_t ino)
+{
+	struct ezfs_inode *di = ezfs_inode_get(img, dir);
+	struct ezfs_dir_entry *de;
+	uint64_t i, n;
+	int err;
+
+	if (img->sb->flags & EZFS_SB_PACKED)
+		return -EROFS;
+	if (strlen(name) > EZFS_MAX_FILENAME_LENGTH)
+		return -ENAMETOOLONG;
+	if (ezfs_dir_find(img, dir, name))
+		return -EEXIST;
+	n = di->nblocks * EZFS_MAX_CHILDREN;
+	de = ezfs_block(img, di->data_block_number);
+	for (i = 0; i < n; i++)
+		if (!de[i].active)
+			break;
+	if (i == n) {
+		err = ezfs_grow(img, dir, di->nblocks + 1);
+		if (err)
+			return err;
+		di->file_size = di->nblocks * EZFS_BLOCK_SIZE;
+		de = ezfs_block(img, di->data_block_number);
+	}
+	de[i].inode_no = ino;
+	de[i].active = 1;
+	strcpy(de[i].filename, name);
+	return 0;
+}
+
+int ezfs_dir_remove(struct ezfs_image *img, uint64_t dir, const char *name)
+{
+	struct ezfs_dir_entry *de;
+
+	if (img->sb->flags & EZFS_SB_PACKED)
+		return -EROFS;
+	de = ezfs_dir_find(img, dir, name);
+	if (!de)
+		return -ENOENT;
+	memset(de, 0, sizeof(*de));
+	return 0;
+}
+
+int64_t ezfs_file_create(struct ezfs_image *img, uint64_t dir,
+		const char *name)
+{
+	struct ezfs_inode *di;
+	struct timespec now;
+	int64_t ino;
+	int err;
+
+	ino = ezfs_alloc_inode(img);
+	if (ino < 0)
+		return ino;
+	err = ezfs_dir_add(img, dir, name, ino);
+	if (err) {
+		ezfs_free_inode(img, ino);
+		return err;
+	}
+	di = ezfs_inode_get(img, ino);
+	di->mode = S_IFREG | 0666;
+	di->nlink = 1;
+	clock_gettime(CLOCK_REALTIME, &now);
+	di->i_atime = di->i_mtime = di->i_ctime = now;
+	return ino;
+}
+
+/* Append len zero bytes to a file, growing its extent as the module does. */
+int ezfs_file_append(struct ezfs_image *img, uint64_t ino, uint64_t len)
+{
+	struct ezfs_inode *di = ezfs_inode_get(img, ino);
+	uint64_t size = di->file_size + len;
+	int err;
+
+	err = ezfs_grow(img, ino, (size + EZFS_BLOCK_SIZE - 1) /
+		EZFS_BLOCK_SIZE);
+	if (err)
+		return err;
+	di->file_size = size;
+	return 0;
+}
+
+int ezfs_file_delete(struct ezfs_image *img, uint64_t dir, const char *name)
+{
+	struct ezfs_dir_entry *de;
+	struct ezfs_inode *di;
+	uint64_t ino;
+
+	if (img->sb->flags & EZFS_SB_PACKED)
+		return -EROFS;
+	de = ezfs_dir_find(img, dir, name);
+	if (!de)
+		return -ENOENT;
+	ino = de->inode_no;
+	di = ezfs_inode_get(img, ino);
+	if (!di || !S_ISREG(di->mode))
+		return -EISDIR;
+	memset(de, 0, sizeof(*de));
+	if (--di->nlink)
+		return 0;
+	if (di->nblocks)
+		ezfs_free_blocks(img->sb, di->data_block_number, di->nblocks);
+	ezfs_free_inode(img, ino);
+	return 0;
+}
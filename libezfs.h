@@ -0,0 +1,67 @@
+#ifndef __LIBEZFS_H__
+#define __LIBEZFS_H__
+
+/* libezfs works on an ezfs image from user space. The image is mapped
+ * into memory and changed in place with the same on-disk rules as myez.c,
+ * so allocator and directory changes can be tried and measured without
+ * loading the module. Functions return 0 or a block/inode number on
+ * success and a negative errno on failure, like the module does.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* These are the same on a 64-bit architecture */
+#define timespec64 timespec
+
+#include "ezfs.h"
+#include "ezfs_bitmap.h"
+
+struct ezfs_image {
+	int fd;
+	size_t len;
+	char *base;
+	struct ezfs_super_block *sb;
+	struct ezfs_inode *inodes;
+	uint64_t data_blocks; /* data blocks that fit on the device */
+
+	/* Allocation tunables, the same as the module's mount options */
+	unsigned int alloc; /* EZFS_ALLOC_* */
+	unsigned int headroom; /* % of extra blocks to take when a file grows */
+	unsigned int reserved; /* % of data blocks allocation leaves free */
+	uint64_t alloc_cursor; /* where EZFS_ALLOC_NEXT resumes */
+};
+
+/* Map an image. ezfs_image_mkfs then writes an empty file system into it. */
+int ezfs_image_open(struct ezfs_image *img, const char *path, int writable);
+int ezfs_image_open_fd(struct ezfs_image *img, int fd, int writable);
+void ezfs_image_mkfs(struct ezfs_image *img);
+int ezfs_image_sync(struct ezfs_image *img);
+void ezfs_image_close(struct ezfs_image *img);
+
+void *ezfs_block(struct ezfs_image *img, uint64_t blk);
+struct ezfs_inode *ezfs_inode_get(struct ezfs_image *img, uint64_t ino);
+
+/* Bitmaps. ezfs_bitmap.h has the bitmap and block_shares helpers the
+ * module uses, ezfs_free_blocks among them.
+ */
+int64_t ezfs_alloc_inode(struct ezfs_image *img);
+void ezfs_free_inode(struct ezfs_image *img, uint64_t ino);
+int64_t ezfs_alloc_range(struct ezfs_image *img, uint64_t count);
+
+/* Directories */
+struct ezfs_dir_entry *ezfs_dir_find(struct ezfs_image *img, uint64_t dir,
+		const char *name);
+int ezfs_dir_add(struct ezfs_image *img, uint64_t dir, const char *name,
+		uint64_t ino);
+int ezfs_dir_remove(struct ezfs_image *img, uint64_t dir, const char *name);
+
+/* Files */
+int64_t ezfs_file_create(struct ezfs_image *img, uint64_t dir,
+		const char *name);
+int ezfs_file_append(struct ezfs_image *img, uint64_t ino, uint64_t len);
+int ezfs_file_delete(struct ezfs_image *img, uint64_t dir, const char *name);
+
+#endif /* ifndef __LIBEZFS_H__ */
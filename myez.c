@@ -9,18 +9,63 @@
 #include <linux/dcache.h>
 #include <linux/mutex.h>
 #include <linux/writeback.h>
+#include <linux/workqueue.h>
+#include <linux/spinlock.h>
+#include <linux/list.h>
+#include <linux/list_sort.h>
+#include <linux/blkdev.h>
+#include <linux/bio.h>
+#include <linux/fs_parser.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+#include <linux/pagevec.h>
+#include <linux/highmem.h>
+#include <linux/mount.h>
+#include <linux/lz4.h>
+#include <linux/zstd.h>
+#include <linux/mpage.h>
+#include <linux/pagemap.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
 
 #include "ezfs.h"
+#include "ezfs_bitmap.h"
 #include "ezfs_ops.h"
 
+#define CREATE_TRACE_POINTS
+#include "ezfs_trace.h"
+
+static struct dentry *ezfs_debugfs_root;
+static struct kmem_cache *ezfs_inode_cachep;
+
 static void ezfs_free_fc(struct fs_context *fc)
 {
 	kfree(fc->s_fs_info);
 }
 
+static struct inode *ezfs_alloc_inode(struct super_block *sb)
+{
+	struct ezfs_inode_info *ei;
+
+	ei = kmem_cache_alloc(ezfs_inode_cachep, GFP_KERNEL);
+	if (!ei)
+		return NULL;
+	ei->remap_seq = 0;
+	ei->state = 0;
+	return &ei->vfs_inode;
+}
+
 static void ezfs_free_inode(struct inode *inode)
 {
+	kmem_cache_free(ezfs_inode_cachep, EZFS_I(inode));
+}
+
+static void ezfs_inode_init_once(void *obj)
+{
+	struct ezfs_inode_info *ei = obj;
 
+	mutex_init(&ei->remap_lock);
+	inode_init_once(&ei->vfs_inode);
 }
 
 struct ezfs_inode *find_inode_by_number(struct super_block *sb,
@@ -39,59 +84,343 @@ struct ezfs_inode *find_inode_by_number(struct super_block *sb,
 	return (struct ezfs_inode *) (*p)->b_data + offset;
 }
 
-static void ezfs_evict_inode (struct inode *inode)
+/* ezfs_lock guards the bitmaps and the inode store. Packed images are
+ * read-only and never allocate, so they have no lock at all and lookups on
+ * them run fully in parallel.
+ */
+static inline int ezfs_hist_bucket(u64 ns)
 {
-	unsigned long ino = inode->i_ino;
+	return min_t(int, fls64(ns >> 10), EZFS_HIST_BUCKETS - 1);
+}
+
+static inline void ezfs_lock_sb(struct ezfs_sb_buffer_heads *sbh)
+{
+	u64 start;
+
+	if (sbh->packed)
+		return;
+	start = ktime_get_ns();
+	mutex_lock(&sbh->ezfs_lock);
+	sbh->lock_taken = ktime_get_ns();
+	this_cpu_inc(sbh->stats->lock_wait[ezfs_hist_bucket(sbh->lock_taken -
+			start)]);
+	trace_ezfs_lock_acquired(sbh->sb, sbh->lock_taken - start);
+}
+
+static inline void ezfs_unlock_sb(struct ezfs_sb_buffer_heads *sbh)
+{
+	u64 held;
+
+	if (sbh->packed)
+		return;
+	held = ktime_get_ns() - sbh->lock_taken;
+	this_cpu_inc(sbh->stats->lock_hold[ezfs_hist_bucket(held)]);
+	trace_ezfs_lock_released(sbh->sb, held);
+	mutex_unlock(&sbh->ezfs_lock);
+}
+
+/* A deleted file's data blocks are handed to a background worker instead of
+ * being freed in ezfs_evict_inode, so unlink costs the same no matter how
+ * big the file was. The worker frees at most EZFS_RECLAIM_BATCH blocks per
+ * hold of ezfs_lock so writers allocating at the same time are not stalled.
+ */
+#define EZFS_RECLAIM_BATCH	64
+#define EZFS_RECLAIM_DELAY	(HZ / 10)
+
+struct ezfs_reclaim_range {
+	struct list_head list;
+	uint64_t start;
+	uint64_t count;
+	bool discard;
+};
+
+/* Whether count more blocks may be taken without eating into the blocks
+ * reserved for CAP_SYS_RESOURCE. Called with ezfs_lock held.
+ */
+static bool ezfs_may_alloc(struct ezfs_sb_buffer_heads *sbh, uint64_t count)
+{
+	if (!sbh->opts.reserved || capable(CAP_SYS_RESOURCE))
+		return true;
+	return ezfs_within_reserve((struct ezfs_super_block *)
+			sbh->sb_bh->b_data, sbh->data_blocks,
+			sbh->opts.reserved, count);
+}
+
+/* Find count contiguous free data blocks with the mount's allocation
+ * policy, mark them in use and return the first one, or 0 if there is no
+ * such run. Called with ezfs_lock held.
+ */
+static uint64_t ezfs_alloc_range(struct ezfs_sb_buffer_heads *sbh,
+		uint64_t count)
+{
+	uint64_t nbits = sbh->data_blocks, scanned = 0, start = 0;
 	struct ezfs_super_block *ezfs_sb;
-	struct ezfs_sb_buffer_heads *sbh;
-	struct ezfs_inode *ezfs_inode;
-	struct buffer_head *bh;
-	sbh = inode->i_sb->s_fs_info;
+	int64_t bit = -1;
+
 	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
-	ezfs_inode = inode->i_private;
-	// clear inode and data block info.
-	CLEARBIT(ezfs_sb->free_inodes, ino);
-	CLEARBIT(ezfs_sb->free_data_blocks, ezfs_inode->data_block_number -
-			EZFS_ROOT_DATABLOCK_NUMBER);
+	if (!count || count > nbits || !ezfs_may_alloc(sbh, count))
+		goto out;
 
-	// clear skeleton
-	truncate_inode_pages_final(&inode->i_data);
-	clear_inode(inode);
-	ezfs_inode = find_inode_by_number(inode->i_sb, inode->i_ino, &bh);
-	// clear bh and ezfs_inode
-	mutex_lock(ezfs_sb->ezfs_lock);
-	memset(ezfs_inode, 0, sizeof(struct ezfs_inode));
-	mark_buffer_dirty(bh);
-	brelse(bh);
-	mutex_unlock(ezfs_sb->ezfs_lock);
-	// release resource in ezfs
-	mutex_destroy(ezfs_sb->ezfs_lock);
-	kfree(ezfs_sb->ezfs_lock);
-	brelse(sbh->sb_bh);
-	brelse(sbh->i_store_bh);
-	kfree(sbh);
+	switch (sbh->opts.alloc) {
+	case EZFS_ALLOC_NEXT:
+		bit = ezfs_find_run(ezfs_sb, nbits, sbh->alloc_cursor, nbits,
+				count, &scanned);
+		if (bit < 0)
+			bit = ezfs_find_run(ezfs_sb, nbits, 0,
+					sbh->alloc_cursor, count, &scanned);
+		break;
+	case EZFS_ALLOC_BEST:
+		bit = ezfs_find_best_run(ezfs_sb, nbits, count, &scanned);
+		break;
+	default:
+		bit = ezfs_find_run(ezfs_sb, nbits, 0, nbits, count,
+				&scanned);
+		break;
+	}
+	if (bit < 0)
+		goto out;
+
+	ezfs_use_bits(ezfs_sb, bit, count);
+	sbh->alloc_cursor = (bit + count) % nbits;
+	start = bit + EZFS_ROOT_DATABLOCK_NUMBER;
+out:
+	this_cpu_inc(sbh->stats->allocs);
+	this_cpu_add(sbh->stats->alloc_scanned, scanned);
+	trace_ezfs_alloc(sbh->sb, count, start, scanned);
+	return start;
+}
+
+/* ezfs_alloc_range, but if there is no room, wait for the reclaim worker
+ * to free what deleted files left behind and try once more. Called without
+ * ezfs_lock, which the worker takes.
+ */
+static uint64_t ezfs_alloc_range_wait(struct ezfs_sb_buffer_heads *sbh,
+		uint64_t count)
+{
+	uint64_t start;
+
+	ezfs_lock_sb(sbh);
+	start = ezfs_alloc_range(sbh, count);
+	ezfs_unlock_sb(sbh);
+	if (start || !flush_delayed_work(&sbh->reclaim_work))
+		return start;
+	ezfs_lock_sb(sbh);
+	start = ezfs_alloc_range(sbh, count);
+	ezfs_unlock_sb(sbh);
+	return start;
+}
+
+// take the blocks right behind the extent until it is count blocks long
+static bool ezfs_extend_in_place(struct ezfs_sb_buffer_heads *sbh,
+		struct ezfs_inode *di, uint64_t count)
+{
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t i, end = di->data_block_number + di->nblocks;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	if (!ezfs_range_free(ezfs_sb, sbh->data_blocks, end,
+			count - di->nblocks) ||
+	    !ezfs_may_alloc(sbh, count - di->nblocks))
+		return false;
+	for (i = end; i < di->data_block_number + count; i++)
+		SETBIT(ezfs_sb->free_data_blocks, EZFS_DATA_BIT(i));
+	di->nblocks = count;
+	return true;
+}
+
+static int ezfs_range_cmp(void *priv, struct list_head *a,
+		struct list_head *b)
+{
+	struct ezfs_reclaim_range *ra, *rb;
+
+	ra = list_entry(a, struct ezfs_reclaim_range, list);
+	rb = list_entry(b, struct ezfs_reclaim_range, list);
+	if (ra->start == rb->start)
+		return 0;
+	return ra->start < rb->start ? -1 : 1;
 }
 
-static uint64_t get_next_block(struct ezfs_super_block *ezfs_sb)
+/* Sort the ranges and merge the ones that touch, so a batch of deletes turns
+ * into as few discard requests as possible.
+ */
+static void ezfs_coalesce_ranges(struct list_head *ranges)
 {
-	int i = EZFS_ROOT_DATABLOCK_NUMBER;
-	while (i < EZFS_MAX_DATA_BLKS) {
-		if (!IS_SET(ezfs_sb->free_data_blocks, i))
-			return i;
+	struct ezfs_reclaim_range *r, *next;
+
+	list_sort(NULL, ranges, ezfs_range_cmp);
+	list_for_each_entry_safe(r, next, ranges, list) {
+		if (list_is_last(&r->list, ranges))
+			break;
+		if (r->start + r->count != next->start)
+			continue;
+		next->start = r->start;
+		next->count += r->count;
+		list_del(&r->list);
+		kfree(r);
+	}
+}
+
+/* Issue one chained discard for all the ranges and wait for it. The ranges
+ * are still marked in use while this runs, so the allocator can't hand out a
+ * block that is being discarded. Ranges that still share blocks with a
+ * reflinked file are left alone; FITRIM picks them up once they're free.
+ */
+static void ezfs_discard_ranges(struct ezfs_sb_buffer_heads *sbh,
+		struct list_head *ranges)
+{
+	struct super_block *sb = sbh->sb;
+	unsigned int shift = sb->s_blocksize_bits - SECTOR_SHIFT;
+	struct ezfs_super_block *ezfs_sb;
+	struct ezfs_reclaim_range *r;
+	struct bio *bio = NULL;
+	struct blk_plug plug;
+	int err;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	ezfs_lock_sb(sbh);
+	list_for_each_entry(r, ranges, list)
+		r->discard = !ezfs_range_shared(ezfs_sb, r->start, r->count);
+	ezfs_unlock_sb(sbh);
+
+	blk_start_plug(&plug);
+	list_for_each_entry(r, ranges, list) {
+		if (!r->discard)
+			continue;
+		err = __blkdev_issue_discard(sb->s_bdev, r->start << shift,
+				r->count << shift, GFP_NOFS, 0, &bio);
+		if (err)
+			break;
+	}
+	blk_finish_plug(&plug);
+
+	if (bio) {
+		submit_bio_wait(bio);
+		bio_put(bio);
 	}
-	return 0;
 }
 
-static int get_next_inode(struct ezfs_super_block *ezfs_sb)
+static void ezfs_reclaim_worker(struct work_struct *work)
 {
-	int i = EZFS_ROOT_INODE_NUMBER;
-	while (i <= EZFS_MAX_INODES) {
-		if (!IS_SET(ezfs_sb->free_inodes, i)) {
-			SETBIT(ezfs_sb->free_inodes, i);
-			return i;
+	struct ezfs_sb_buffer_heads *sbh = container_of(to_delayed_work(work),
+			struct ezfs_sb_buffer_heads, reclaim_work);
+	struct ezfs_super_block *ezfs_sb;
+	struct ezfs_reclaim_range *r;
+	uint64_t n, budget;
+	LIST_HEAD(batch);
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+
+	spin_lock(&sbh->reclaim_lock);
+	list_splice_init(&sbh->reclaim_list, &batch);
+	spin_unlock(&sbh->reclaim_lock);
+
+	if (sbh->opts.discard && !list_empty(&batch)) {
+		ezfs_coalesce_ranges(&batch);
+		ezfs_discard_ranges(sbh, &batch);
+	}
+
+	while (!list_empty(&batch)) {
+		budget = EZFS_RECLAIM_BATCH;
+		ezfs_lock_sb(sbh);
+		while (budget && !list_empty(&batch)) {
+			r = list_first_entry(&batch, struct ezfs_reclaim_range,
+					list);
+			n = min(r->count, budget);
+			ezfs_free_blocks(ezfs_sb, r->start, n);
+			r->start += n;
+			r->count -= n;
+			budget -= n;
+			if (!r->count) {
+				list_del(&r->list);
+				kfree(r);
+			}
 		}
+		mark_buffer_dirty(sbh->sb_bh);
+		ezfs_unlock_sb(sbh);
+		cond_resched();
+	}
+}
+
+static void ezfs_queue_reclaim(struct ezfs_sb_buffer_heads *sbh,
+		uint64_t start, uint64_t count)
+{
+	struct ezfs_super_block *ezfs_sb;
+	struct ezfs_reclaim_range *r;
+
+	r = kmalloc(sizeof(*r), GFP_NOFS);
+	if (!r) {
+		// no memory to defer the work, so free the range right here
+		ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+		ezfs_lock_sb(sbh);
+		ezfs_free_blocks(ezfs_sb, start, count);
+		mark_buffer_dirty(sbh->sb_bh);
+		ezfs_unlock_sb(sbh);
+		return;
 	}
-	return -1;
+	r->start = start;
+	r->count = count;
+
+	spin_lock(&sbh->reclaim_lock);
+	list_add_tail(&r->list, &sbh->reclaim_list);
+	spin_unlock(&sbh->reclaim_lock);
+	queue_delayed_work(system_unbound_wq, &sbh->reclaim_work,
+			EZFS_RECLAIM_DELAY);
+}
+
+static void ezfs_trim_slack(struct inode *inode);
+
+static void ezfs_evict_inode(struct inode *inode)
+{
+	struct ezfs_sb_buffer_heads *sbh = inode->i_sb->s_fs_info;
+	struct ezfs_super_block *ezfs_sb;
+	struct ezfs_inode *di;
+	struct buffer_head *bh;
+	uint64_t start, count;
+
+	truncate_inode_pages_final(&inode->i_data);
+	if (inode->i_nlink && inode->i_private && S_ISREG(inode->i_mode) &&
+	    !sb_rdonly(inode->i_sb))
+		ezfs_trim_slack(inode);
+	invalidate_inode_buffers(inode);
+	clear_inode(inode);
+	// still linked somewhere, only the in-core inode goes away
+	if (inode->i_nlink)
+		return;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	di = find_inode_by_number(inode->i_sb, inode->i_ino, &bh);
+	if (IS_ERR(di))
+		return;
+
+	// release the inode slot now, the data blocks in the background
+	ezfs_lock_sb(sbh);
+	start = di->data_block_number;
+	count = di->nblocks;
+	memset(di, 0, sizeof(struct ezfs_inode));
+	mark_buffer_dirty(bh);
+	CLEARBIT(ezfs_sb->free_inodes, EZFS_INODE_BIT(inode->i_ino));
+	mark_buffer_dirty(sbh->sb_bh);
+	ezfs_unlock_sb(sbh);
+	brelse(bh);
+
+	if (start && count)
+		ezfs_queue_reclaim(sbh, start, count);
+}
+
+static void ezfs_put_super(struct super_block *sb)
+{
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+
+	// every inode is evicted by now, so nothing can queue more work
+	flush_delayed_work(&sbh->reclaim_work);
+
+	debugfs_remove_recursive(sbh->debugfs);
+	cancel_delayed_work_sync(&sbh->commit_work);
+	kvfree(sbh->zstd_ws);
+	mutex_destroy(&sbh->zstd_lock);
+	mutex_destroy(&sbh->ezfs_lock);
+	brelse(sbh->sb_bh);
+	brelse(sbh->i_store_bh);
 }
 
 static int ezfs_write_inode (struct inode *inode,
@@ -100,18 +429,16 @@ static int ezfs_write_inode (struct inode *inode,
 	struct ezfs_inode *di;
 	struct buffer_head *bh;
 	struct ezfs_sb_buffer_heads *sbh;
-	struct ezfs_super_block *ezfs_sb;
 	unsigned long ino = inode->i_ino;
 	int err = 0;
 
 	sbh = inode->i_sb->s_fs_info;
-	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
 
 	di = find_inode_by_number(inode->i_sb, ino, &bh);
 	if (IS_ERR(di))
 		return PTR_ERR(di);
 
-	mutex_lock(ezfs_sb->ezfs_lock);
+	ezfs_lock_sb(sbh);
 	di->mode = inode->i_mode;
 	di->uid = i_uid_read(inode);
 	di->gid = i_gid_read(inode);
@@ -119,6 +446,7 @@ static int ezfs_write_inode (struct inode *inode,
 	di->i_atime = inode->i_atime;
 	di->i_mtime = inode->i_mtime;
 	di->i_ctime = inode->i_ctime;
+	di->file_size = inode->i_size;
 
 	mark_buffer_dirty(bh);
 	if (wbc->sync_mode == WB_SYNC_ALL) {
@@ -127,95 +455,171 @@ static int ezfs_write_inode (struct inode *inode,
 			err = -EIO;
 	}
 	brelse(bh);
-	mutex_unlock(ezfs_sb->ezfs_lock);
+	ezfs_unlock_sb(sbh);
 	return err;
 }
 
-static int ezfs_create_inode(struct inode *inode)
+static int ezfs_show_options(struct seq_file *m, struct dentry *root)
 {
-	struct ezfs_inode *di;
-	struct buffer_head *bh;
-	struct ezfs_sb_buffer_heads *sbh;
-	struct ezfs_super_block *ezfs_sb;
-	unsigned long ino = inode->i_ino;
-
-	sbh = inode->i_sb->s_fs_info;
-	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
-	SETBIT(ezfs_sb->free_inodes, ino);
-	di = find_inode_by_number(inode->i_sb, ino, &bh);
-	if (IS_ERR(di))
-		return PTR_ERR(di);
-
-	if (ino == EZFS_ROOT_INODE_NUMBER) {
-		di->data_block_number = EZFS_ROOT_DATABLOCK_NUMBER;
-		di->mode = S_IFDIR | 0777;
-		SETBIT(ezfs_sb->free_data_blocks, di->data_block_number);
-	} else {
-		uint64_t block_number = get_next_block(ezfs_sb);
-		if (block_number == 0) {
-			return PTR_ERR(di);
-		}
-		di->data_block_number = block_number;
-		di->mode = S_IFREG | 0666;
-		SETBIT(ezfs_sb->free_data_blocks, di->data_block_number);
-	}
-
-	di->uid = di->gid = 10000;
-	di->i_atime = inode->i_atime;
-	di->i_mtime = inode->i_mtime;
-	di->i_ctime = inode->i_ctime;
-	mark_buffer_dirty(bh);
-	brelse(bh);
-	mutex_unlock(ezfs_sb->ezfs_lock);
-	return get_next_inode(ezfs_sb);
+	struct ezfs_sb_buffer_heads *sbh = root->d_sb->s_fs_info;
+
+	if (sbh->opts.discard)
+		seq_puts(m, ",discard");
+	if (sbh->opts.compress == EZFS_COMPR_LZ4)
+		seq_puts(m, ",compress=lz4");
+	else if (sbh->opts.compress == EZFS_COMPR_ZSTD)
+		seq_puts(m, ",compress=zstd");
+	if (sbh->opts.dir_prefetch)
+		seq_puts(m, ",dir_prefetch");
+	if (sbh->opts.alloc == EZFS_ALLOC_NEXT)
+		seq_puts(m, ",alloc=next");
+	else if (sbh->opts.alloc == EZFS_ALLOC_BEST)
+		seq_puts(m, ",alloc=best");
+	if (sbh->opts.headroom)
+		seq_printf(m, ",headroom=%u", sbh->opts.headroom);
+	if (sbh->opts.reserved)
+		seq_printf(m, ",reserved=%u", sbh->opts.reserved);
+	if (sbh->opts.commit)
+		seq_printf(m, ",commit=%u", sbh->opts.commit);
+	return 0;
 }
 
 static const struct super_operations ezfs_sops = {
-	//.alloc_inode	= bfs_alloc_inode,
-	//.free_inode	= ezfs_free_inode,
+	.alloc_inode	= ezfs_alloc_inode,
+	.free_inode	= ezfs_free_inode,
 	.write_inode	= ezfs_write_inode,
-	//.evict_inode	= ezfs_evict_inode,
-	.drop_inode	= generic_delete_inode,
-	// .put_super	= bfs_put_super,
+	.evict_inode	= ezfs_evict_inode,
+	.drop_inode	= generic_drop_inode,
+	.put_super	= ezfs_put_super,
 	.statfs		= simple_statfs,
+	.show_options	= ezfs_show_options,
 };
 
+// the child's type comes from the inode table we keep pinned in memory
+static unsigned char ezfs_dtype(struct super_block *sb, uint64_t ino)
+{
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_inode *di;
+
+	if (ino < EZFS_ROOT_INODE_NUMBER || ino > EZFS_MAX_INODES)
+		return DT_UNKNOWN;
+	di = (struct ezfs_inode *) sbh->i_store_bh->b_data +
+		EZFS_INODE_BIT(ino);
+	return S_DT(di->mode);
+}
+
+/* With -o dir_prefetch, readdir pulls every child it lists into the inode
+ * cache, so the stat() calls of an ls -l or find that follow are served
+ * without setting up a new inode each.
+ */
+static void ezfs_prefetch_inode(struct inode *dir, uint64_t ino)
+{
+	struct inode *inode;
+
+	if (ino < EZFS_ROOT_INODE_NUMBER || ino > EZFS_MAX_INODES)
+		return;
+	inode = ezfs_get_inode(dir->i_sb, dir, ino);
+	if (!IS_ERR(inode))
+		iput(inode);
+}
+
+/* Directory blocks live in the directory inode's page cache, mapped by
+ * ezfs_get_block like file data, instead of being read block by block
+ * through the buffer cache.
+ */
+static inline unsigned long ezfs_dir_pages(struct inode *dir)
+{
+	struct ezfs_inode *di = dir->i_private;
+
+	return di->nblocks;
+}
+
+static struct page *ezfs_get_dir_page(struct inode *dir, pgoff_t n)
+{
+	struct page *page;
+
+	page = read_mapping_page(dir->i_mapping, n, NULL);
+	if (!IS_ERR(page))
+		kmap(page);
+	return page;
+}
+
+static inline void ezfs_put_dir_page(struct page *page)
+{
+	kunmap(page);
+	put_page(page);
+}
+
+/* Bring the rest of a multi-block directory into the page cache with one
+ * readahead request instead of a read per block.
+ */
+static void ezfs_dir_readahead(struct inode *dir, struct file *file,
+		pgoff_t index)
+{
+	struct address_space *mapping = dir->i_mapping;
+	unsigned long npages = ezfs_dir_pages(dir);
+	struct file_ra_state ra, *rap = &ra;
+	struct page *page;
+
+	if (index + 1 >= npages)
+		return;
+	page = find_get_page(mapping, index);
+	if (page) {
+		put_page(page);
+		return;
+	}
+	if (file)
+		rap = &file->f_ra;
+	else
+		file_ra_state_init(&ra, mapping);
+	page_cache_sync_readahead(mapping, rap, file, index, npages - index);
+}
+
 static int ezfs_readdir(struct file *f, struct dir_context *ctx)
 {
 	struct inode *inode;
-	struct buffer_head *bh;
-	struct ezfs_inode *ez_inode;
 	struct ezfs_dir_entry *de;
+	struct ezfs_sb_buffer_heads *sbh;
 	struct super_block *sb;
-	int block, pos, i;
-	mode_t mode;
+	unsigned long npages, n;
+	struct page *page;
+	loff_t pos;
+	int i;
 
 	inode = file_inode(f);
 	if (inode == NULL) {
 		return -1;
 	}
-	ez_inode = inode->i_private;
-	mode = inode->i_mode;
 	sb = inode->i_sb;
-	block = ez_inode->data_block_number;
-	bh = sb_bread(sb, block);
-	if (!bh)
-		return -EINVAL;
+	sbh = sb->s_fs_info;
+	npages = ezfs_dir_pages(inode);
 
-	if (!dir_emit_dots(f, ctx)) {
+	if (!dir_emit_dots(f, ctx))
 		return 0;
-	}
 
 	pos = ctx->pos - 2;
-	for (i = pos; i < EZFS_MAX_CHILDREN; i++, ctx->pos++) {
-		de = (struct ezfs_dir_entry *) bh->b_data + i;
-		if (!de->active)
-			continue;
-		if (!dir_emit(ctx, de->filename, strnlen(de->filename,
-			EZFS_FILENAME_BUF_SIZE), de->inode_no, S_DT(mode)))
-			break;
+	n = pos / EZFS_MAX_CHILDREN;
+	i = pos % EZFS_MAX_CHILDREN;
+	ezfs_dir_readahead(inode, f, n);
+	for (; n < npages; n++, i = 0) {
+		page = ezfs_get_dir_page(inode, n);
+		if (IS_ERR(page))
+			return PTR_ERR(page);
+		de = (struct ezfs_dir_entry *) page_address(page) + i;
+		for (; i < EZFS_MAX_CHILDREN; i++, de++, ctx->pos++) {
+			if (!de->active)
+				continue;
+			if (!dir_emit(ctx, de->filename, strnlen(de->filename,
+				EZFS_FILENAME_BUF_SIZE), de->inode_no,
+				ezfs_dtype(sb, de->inode_no))) {
+				ezfs_put_dir_page(page);
+				return 0;
+			}
+			if (sbh->opts.dir_prefetch)
+				ezfs_prefetch_inode(inode, de->inode_no);
+		}
+		ezfs_put_dir_page(page);
 	}
-	brelse(bh);
 	return 0;
 }
 
@@ -228,108 +632,234 @@ static inline int ezfs_namecmp(int len, const unsigned char *name,
 	return !memcmp(name, buffer, len);
 }
 
-static struct buffer_head *ezfs_find_entry(struct inode *dir,
+// strcmp() order of a name against a directory entry, as the formatter sorts
+static int ezfs_nameorder(int len, const unsigned char *name,
+		const char *buffer)
+{
+	int blen = strnlen(buffer, EZFS_FILENAME_BUF_SIZE);
+	int ret = memcmp(name, buffer, min(len, blen));
+
+	if (ret)
+		return ret;
+	return len - blen;
+}
+
+/* Packed directories hold their entries sorted and without holes, with the
+ * unused slots at the end, so the whole directory can be binary searched.
+ */
+static struct ezfs_dir_entry *ezfs_find_entry_sorted(struct inode *dir,
 			const struct qstr *child,
-			struct ezfs_dir_entry **res_dir)
+			struct page **res_page,
+			unsigned int *probes)
 {
-	struct buffer_head *bh = NULL;
+	unsigned long lo = 0, hi, mid, n, cur = ULONG_MAX;
 	struct ezfs_dir_entry *de;
-	struct ezfs_inode *ezfs_ino;
+	struct page *page = NULL;
+	int cmp;
+
+	hi = ezfs_dir_pages(dir) * EZFS_MAX_CHILDREN;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		n = mid / EZFS_MAX_CHILDREN;
+		if (n != cur) {
+			if (page)
+				ezfs_put_dir_page(page);
+			page = ezfs_get_dir_page(dir, n);
+			if (IS_ERR(page))
+				return NULL;
+			cur = n;
+		}
+		de = (struct ezfs_dir_entry *) page_address(page) +
+			mid % EZFS_MAX_CHILDREN;
+		(*probes)++;
+		cmp = de->active ? ezfs_nameorder(child->len, child->name,
+				de->filename) : -1;
+		if (!cmp) {
+			*res_page = page;
+			return de;
+		}
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	if (page)
+		ezfs_put_dir_page(page);
+	return NULL;
+}
+
+/* Returns the entry for child with its directory page in *res_page, which
+ * the caller releases with ezfs_put_dir_page.
+ */
+static struct ezfs_dir_entry *ezfs_find_entry(struct inode *dir,
+			const struct qstr *child,
+			struct page **res_page)
+{
+	struct ezfs_sb_buffer_heads *sbh = dir->i_sb->s_fs_info;
 	const unsigned char *name = child->name;
 	int namelen = child->len;
-	int block, end_block;
-	int offset = 0;
+	struct ezfs_dir_entry *de = NULL;
+	unsigned int probes = 0;
+	unsigned long npages, n;
+	struct page *page;
+	int i;
 
-	*res_dir = NULL;
+	*res_page = NULL;
 	if (namelen > EZFS_MAX_FILENAME_LENGTH)
 		return NULL;
-	ezfs_ino = dir->i_private;
-	block = ezfs_ino->data_block_number;
-	end_block = block + ezfs_ino->nblocks;
+	npages = ezfs_dir_pages(dir);
+	ezfs_dir_readahead(dir, NULL, 0);
+	if (sbh->packed) {
+		de = ezfs_find_entry_sorted(dir, child, res_page, &probes);
+		goto out;
+	}
 
 	// read each block of the dir
-	while (block < end_block) {
-		bh = sb_bread(dir->i_sb, block);
-		if (!bh) {
-			block++;
+	for (n = 0; n < npages; n++) {
+		page = ezfs_get_dir_page(dir, n);
+		if (IS_ERR(page))
 			continue;
-		}
-		de = (struct ezfs_dir_entry *) (bh->b_data + offset);
-		offset += sizeof(struct ezfs_dir_entry);
-		if (ezfs_namecmp(namelen, name, de->filename)) {
-			*res_dir = de;
-			//brelse(bh);
-			return bh;
-		}
+		de = (struct ezfs_dir_entry *) page_address(page);
 		// read each dentry within the block
-		if (offset < bh->b_size)
-			continue;
-		brelse(bh);
-		bh = NULL;
-		offset = 0;
-		block++;
+		for (i = 0; i < EZFS_MAX_CHILDREN; i++, de++) {
+			probes++;
+			if (de->active &&
+			    ezfs_namecmp(namelen, name, de->filename)) {
+				*res_page = page;
+				goto out;
+			}
+		}
+		ezfs_put_dir_page(page);
 	}
-	brelse(bh);
-	return NULL;
+	de = NULL;
+out:
+	this_cpu_inc(sbh->stats->lookups);
+	this_cpu_add(sbh->stats->lookup_probes, probes);
+	trace_ezfs_lookup(dir, child, probes, de ? de->inode_no : 0);
+	return de;
 }
 
 static struct dentry *ezfs_lookup (struct inode *dir, struct dentry *dentry,
 					unsigned int flags)
 {
 	struct inode *inode = NULL;
-	struct buffer_head *bh;
+	struct page *page;
 	struct ezfs_dir_entry *de;
-	struct ezfs_super_block *ezfs_sb;
 	struct ezfs_sb_buffer_heads *sbh;
+	uint64_t ino;
 
 	if (dentry->d_name.len > EZFS_MAX_FILENAME_LENGTH)
 		return ERR_PTR(-ENAMETOOLONG);
 
 	//look up the dentry name in the dir and do string match
 	sbh = dir->i_sb->s_fs_info;
-	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
 
-	mutex_lock(ezfs_sb->ezfs_lock);
-	bh = ezfs_find_entry(dir, &dentry->d_name, &de);
+	ezfs_lock_sb(sbh);
+	de = ezfs_find_entry(dir, &dentry->d_name, &page);
 
 	// take the inode number to get the inode
-	if (bh) {
-		brelse(bh);
-		inode = ezfs_get_inode(dir->i_sb, dir, de->inode_no);
+	if (de) {
+		ino = de->inode_no;
+		ezfs_put_dir_page(page);
+		inode = ezfs_get_inode(dir->i_sb, dir, ino);
 	}
-	mutex_unlock(ezfs_sb->ezfs_lock);
+	ezfs_unlock_sb(sbh);
 
 	return d_splice_alias(inode, dentry); //associate the inode with dentry
 }
 
-static int ezfs_move_block(unsigned long from, unsigned long to,
-			struct super_block *sb)
+static int ezfs_unlink(struct inode *dir, struct dentry *dentry)
 {
-	struct buffer_head *bh, *new;
+	struct inode *inode = d_inode(dentry);
+	struct page *page;
+	struct ezfs_dir_entry *de;
+	struct ezfs_sb_buffer_heads *sbh;
 
-	bh = sb_bread(sb, from);
-	if (!bh)
-		return -EIO;
-	new = sb_getblk(sb, to);
-	memcpy(new->b_data, bh->b_data, bh->b_size);
-	mark_buffer_dirty(new);
-	bforget(bh);
-	brelse(new);
+	sbh = dir->i_sb->s_fs_info;
+
+	ezfs_lock_sb(sbh);
+	de = ezfs_find_entry(dir, &dentry->d_name, &page);
+	if (!de) {
+		ezfs_unlock_sb(sbh);
+		return -ENOENT;
+	}
+	lock_page(page);
+	memset(de, 0, sizeof(struct ezfs_dir_entry));
+	set_page_dirty(page);
+	unlock_page(page);
+	ezfs_put_dir_page(page);
+	ezfs_unlock_sb(sbh);
+
+	// the blocks are reclaimed once the last reference is dropped
+	dir->i_ctime = dir->i_mtime = current_time(dir);
+	mark_inode_dirty(dir);
+	inode->i_ctime = dir->i_ctime;
+	inode_dec_link_count(inode);
 	return 0;
 }
 
-static int ezfs_move_blocks(struct super_block *sb, unsigned long start,
-				unsigned long end, unsigned long where)
+/* Copy blocks on the device with bios of up to EZFS_COPY_CHUNK pages, so
+ * data never passes through the buffer cache or user space. The source is
+ * left alone since other files may still be reading it.
+ */
+#define EZFS_COPY_CHUNK	BIO_MAX_PAGES
+
+static int ezfs_rw_blocks(struct super_block *sb, unsigned int op,
+		unsigned long block, struct page **pages, unsigned long n)
 {
+	struct bio *bio;
 	unsigned long i;
+	int err;
 
-	for (i = start; i < end; i++) {
-		if (ezfs_move_block(i, where + i, sb)) {
-			printk("failed to move blocks\n");
+	bio = bio_alloc(GFP_NOFS, n);
+	bio_set_dev(bio, sb->s_bdev);
+	bio->bi_iter.bi_sector = block << (sb->s_blocksize_bits - SECTOR_SHIFT);
+	bio->bi_opf = op;
+	for (i = 0; i < n; i++) {
+		if (!bio_add_page(bio, pages[i], sb->s_blocksize, 0)) {
+			bio_put(bio);
 			return -EIO;
 		}
 	}
-	return 0;
+	err = submit_bio_wait(bio);
+	bio_put(bio);
+	return err;
+}
+
+static int ezfs_copy_blocks(struct super_block *sb, unsigned long from,
+				unsigned long to, unsigned long count)
+{
+	struct address_space *bdev_mapping = sb->s_bdev->bd_inode->i_mapping;
+	unsigned long i, n, done, npages;
+	struct page **pages;
+	int err = 0;
+
+	npages = min_t(unsigned long, count, EZFS_COPY_CHUNK);
+	pages = kcalloc(npages, sizeof(*pages), GFP_NOFS);
+	if (!pages)
+		return -ENOMEM;
+	for (i = 0; i < npages; i++) {
+		pages[i] = alloc_page(GFP_NOFS);
+		if (!pages[i]) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (done = 0; done < count && !err; done += n) {
+		n = min(count - done, npages);
+		err = ezfs_rw_blocks(sb, REQ_OP_READ, from + done, pages, n);
+		if (!err)
+			err = ezfs_rw_blocks(sb, REQ_OP_WRITE, to + done,
+					pages, n);
+	}
+	// don't let stale buffer cache copies of the destination shadow it
+	invalidate_mapping_pages(bdev_mapping, to, to + count - 1);
+out:
+	for (i = 0; i < npages && pages[i]; i++)
+		__free_page(pages[i]);
+	kfree(pages);
+	return err;
 }
 
 static int ezfs_get_block(struct inode *inode, sector_t block,
@@ -342,7 +872,6 @@ static int ezfs_get_block(struct inode *inode, sector_t block,
 	struct ezfs_inode *ezfs_inode = inode->i_private;
 	uint64_t nblocks, block_num;
 	unsigned long phys;
-	int err;
 
 	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
 	nblocks = ezfs_inode->nblocks;
@@ -351,43 +880,27 @@ static int ezfs_get_block(struct inode *inode, sector_t block,
 
 	if (!create) {
 		if (phys < block_num + nblocks) {
-			printk("b=%08lx granted\n", (unsigned long) block);
+			trace_ezfs_get_block(inode, block, phys, create);
 			map_bh(bh_result, sb, phys);
 		}
 		return 0;
 	}
 
 	if (block_num > 0 && phys < block_num + nblocks) {
+		// writers unshare reflinked extents before they get here
+		if (WARN_ON_ONCE(ezfs_sb->block_shares[EZFS_DATA_BIT(phys)]))
+			return -EIO;
+		trace_ezfs_get_block(inode, block, phys, create);
 		map_bh(bh_result, sb, phys);
+		// past EOF: have the page cache zero what the write won't fill
+		if (block >= DIV_ROUND_UP(i_size_read(inode), EZFS_BLOCK_SIZE))
+			set_buffer_new(bh_result);
 		return 0;
 	}
-	if (phys >= EZFS_MAX_DATA_BLKS)
-		return -ENOSPC;
-
-	mutex_lock(ezfs_sb->ezfs_lock);
-	phys = get_next_block(ezfs_sb);
-	if (phys + block >= EZFS_MAX_DATA_BLKS) {
-		err = -ENOSPC;
-		goto out;
-	}
-	if (ezfs_inode->data_block_number != 0) {
-		err = ezfs_move_blocks(inode->i_sb, block_num,
-				nblocks + block_num, phys);
-		if (err) {
-			printk("failed to move \n");
-			goto out;
-		}
-	} else {
-		err = 0;
-	}
-	ezfs_inode->data_block_number = phys;
-	phys += block;
-	mark_inode_dirty(inode);
-	map_bh(bh_result, sb, phys);
-
-out:	mutex_unlock(ezfs_sb->ezfs_lock);
-	return err;
-
+	/* Writers grow the extent with ezfs_grow_extent before they get
+	 * here, so there's nothing to map outside it.
+	 */
+	return -ENOSPC;
 }
 
 static int ezfs_readpage(struct file *file, struct page *page)
@@ -395,11 +908,22 @@ static int ezfs_readpage(struct file *file, struct page *page)
 	return block_read_full_page(page, ezfs_get_block);
 }
 
+static void ezfs_readahead(struct readahead_control *rac)
+{
+	mpage_readahead(rac, ezfs_get_block);
+}
+
 static int ezfs_writepage(struct page *page, struct writeback_control *wbc)
 {
 	return block_write_full_page(page, ezfs_get_block, wbc);
 }
 
+static int ezfs_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	return mpage_writepages(mapping, wbc, ezfs_get_block);
+}
+
 static void ezfs_write_failed(struct address_space *mapping, loff_t to)
 {
 	struct inode *inode = mapping->host;
@@ -421,43 +945,1593 @@ static int ezfs_write_begin(struct file *file, struct address_space *mapping,
 	return ret;
 }
 
-const struct inode_operations ezfs_dir_inode_ops = {
-	//.create = ezfs_create,
-	.lookup	= ezfs_lookup,
-	.link	= simple_link,
-	.unlink = simple_unlink,
-	.rename = simple_rename,
-};
+/* Transparent compression. A compressed file's pages carry no buffers:
+ * readpage decompresses a whole chunk out of the extent and fills every page
+ * of it that isn't cached yet, and writeback compresses each dirty chunk and
+ * writes it back where it was if it still fits there, or behind the last
+ * chunk. Only when the extent is full and can't grow in place is the file
+ * compacted into a new one. Writeback changes chunks under the file's
+ * remap_lock and bumps remap_seq, and readpage reads a chunk over again if
+ * that happened while it was reading.
+ */
+#define EZFS_ZSTD_LEVEL	3
 
-const struct inode_operations ezfs_file_inode_ops = {
-	.setattr = simple_setattr,
-	.getattr = simple_getattr,
-};
+static const struct address_space_operations ezfs_aops;
 
-const struct file_operations ezfs_file_ops = {
-	.read_iter  	= generic_file_read_iter,
-	.write_iter 	= generic_file_write_iter,
-	.llseek    	= generic_file_llseek,
-	.mmap	    	= generic_file_mmap,
-	.splice_read	= generic_file_splice_read,
-};
+static inline unsigned int ezfs_compr_algo(struct inode *inode)
+{
+	struct ezfs_inode *di = inode->i_private;
 
-const struct file_operations ezfs_dir_file_ops = {
+	return di->flags & EZFS_INODE_COMPR_MASK;
+}
+
+static size_t ezfs_compr_workspace_size(unsigned int algo)
+{
+	if (algo == EZFS_COMPR_ZSTD)
+		return ZSTD_CCtxWorkspaceBound(ZSTD_getParams(EZFS_ZSTD_LEVEL,
+				EZFS_CHUNK_SIZE, 0).cParams);
+	return LZ4_MEM_COMPRESS;
+}
+
+/* Returns the compressed length, or 0 if the chunk doesn't fit in cap bytes
+ * and should be stored raw.
+ */
+static size_t ezfs_compress(unsigned int algo, void *ws, const void *src,
+		size_t len, void *dst, size_t cap)
+{
+	ZSTD_parameters params;
+	ZSTD_CCtx *cctx;
+	size_t ret;
+	int n;
+
+	if (!cap)
+		return 0;
+	switch (algo) {
+	case EZFS_COMPR_LZ4:
+		n = LZ4_compress_default(src, dst, len, cap, ws);
+		return n > 0 ? n : 0;
+	case EZFS_COMPR_ZSTD:
+		params = ZSTD_getParams(EZFS_ZSTD_LEVEL, len, 0);
+		cctx = ZSTD_initCCtx(ws, ezfs_compr_workspace_size(algo));
+		if (!cctx)
+			return 0;
+		ret = ZSTD_compressCCtx(cctx, dst, cap, src, len, params);
+		return ZSTD_isError(ret) ? 0 : ret;
+	}
+	return 0;
+}
+
+static int ezfs_decompress(struct ezfs_sb_buffer_heads *sbh,
+		unsigned int algo, const void *src, size_t len, void *dst,
+		size_t size)
+{
+	size_t wsize, ret;
+	int err = 0;
+
+	switch (algo) {
+	case EZFS_COMPR_LZ4:
+		if (LZ4_decompress_safe(src, dst, len, size) != size)
+			return -EIO;
+		return 0;
+	case EZFS_COMPR_ZSTD:
+		mutex_lock(&sbh->zstd_lock);
+		if (!sbh->zstd_dctx) {
+			wsize = ZSTD_DCtxWorkspaceBound();
+			sbh->zstd_ws = kvmalloc(wsize, GFP_NOFS);
+			if (sbh->zstd_ws)
+				sbh->zstd_dctx = ZSTD_initDCtx(sbh->zstd_ws,
+						wsize);
+			if (!sbh->zstd_dctx) {
+				kvfree(sbh->zstd_ws);
+				sbh->zstd_ws = NULL;
+				err = -ENOMEM;
+			}
+		}
+		if (!err) {
+			ret = ZSTD_decompressDCtx(sbh->zstd_dctx, dst, size,
+					src, len);
+			if (ZSTD_isError(ret) || ret != size)
+				err = -EIO;
+		}
+		mutex_unlock(&sbh->zstd_lock);
+		return err;
+	}
+	return -EIO;
+}
+
+// fill the other pages of a decompressed chunk that aren't cached yet
+static void ezfs_fill_chunk_pages(struct address_space *mapping,
+		pgoff_t first, pgoff_t skip, const void *data)
+{
+	pgoff_t idx, end = DIV_ROUND_UP(i_size_read(mapping->host), PAGE_SIZE);
+	struct page *page;
+	void *kaddr;
+
+	end = min_t(pgoff_t, end, first + EZFS_CHUNK_BLOCKS);
+	for (idx = first; idx < end; idx++) {
+		if (idx == skip)
+			continue;
+		page = grab_cache_page_nowait(mapping, idx);
+		if (!page)
+			continue;
+		if (!PageUptodate(page)) {
+			kaddr = kmap_atomic(page);
+			memcpy(kaddr, data + (idx - first) * PAGE_SIZE,
+					PAGE_SIZE);
+			kunmap_atomic(kaddr);
+			flush_dcache_page(page);
+			SetPageUptodate(page);
+		}
+		unlock_page(page);
+		put_page(page);
+	}
+}
+
+static inline uint64_t ezfs_chunk_blocks(const struct ezfs_chunk *chunk)
+{
+	return DIV_ROUND_UP(chunk->length ? chunk->length : chunk->size,
+			EZFS_BLOCK_SIZE);
+}
+
+/* Decompress chunk c of the file, whose extent is nblocks blocks from
+ * start, into out, which takes EZFS_CHUNK_SIZE bytes. Chunks that were
+ * never written read as zeroes. The caller holds remap_lock, or checks
+ * remap_seq afterwards in case writeback rewrote the chunk meanwhile.
+ */
+static int ezfs_read_chunk(struct inode *inode, uint64_t start,
+		uint64_t nblocks, uint64_t c, void *out)
+{
+	struct super_block *sb = inode->i_sb;
+	uint64_t nbl, i;
+	struct buffer_head *bh;
+	struct ezfs_chunk chunk;
+	void *in;
+	int err = 0;
+
+	memset(out, 0, EZFS_CHUNK_SIZE);
+	if (!start || c >= EZFS_MAX_CHUNKS)
+		return 0;
+	bh = sb_bread(sb, start);
+	if (!bh)
+		return -EIO;
+	chunk = ((struct ezfs_chunk *) bh->b_data)[c];
+	brelse(bh);
+	if (!chunk.size)
+		return 0;
+
+	nbl = ezfs_chunk_blocks(&chunk);
+	if (chunk.size > EZFS_CHUNK_SIZE || !chunk.offset ||
+	    chunk.offset + nbl > nblocks)
+		return -EIO;
+	in = kvmalloc(nbl * EZFS_BLOCK_SIZE, GFP_NOFS);
+	if (!in)
+		return -ENOMEM;
+	for (i = 0; i < nbl; i++)
+		sb_breadahead(sb, start + chunk.offset + i);
+	for (i = 0; i < nbl; i++) {
+		bh = sb_bread(sb, start + chunk.offset + i);
+		if (!bh) {
+			err = -EIO;
+			goto out;
+		}
+		memcpy(in + i * EZFS_BLOCK_SIZE, bh->b_data, EZFS_BLOCK_SIZE);
+		brelse(bh);
+	}
+	if (chunk.length)
+		err = ezfs_decompress(sb->s_fs_info, ezfs_compr_algo(inode),
+				in, chunk.length, out, chunk.size);
+	else
+		memcpy(out, in, chunk.size);
+out:
+	kvfree(in);
+	return err;
+}
+
+static int ezfs_compr_readpage(struct file *file, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *di = inode->i_private;
+	pgoff_t first = round_down(page->index, EZFS_CHUNK_BLOCKS);
+	uint64_t start, nblocks;
+	unsigned long seq;
+	void *out, *kaddr;
+	bool moved;
+	int err;
+
+	out = kvmalloc(EZFS_CHUNK_SIZE, GFP_NOFS);
+	if (!out) {
+		err = -ENOMEM;
+		goto out;
+	}
+	/* remap_lock is only held to see where the file is. Writeback may
+	 * rewrite or move the chunk while it is read, and reclaim hand out
+	 * its old blocks, so read it again if that happened.
+	 */
+	do {
+		mutex_lock(&ei->remap_lock);
+		seq = ei->remap_seq;
+		start = di->data_block_number;
+		nblocks = di->nblocks;
+		mutex_unlock(&ei->remap_lock);
+		err = ezfs_read_chunk(inode, start, nblocks,
+				page->index / EZFS_CHUNK_BLOCKS, out);
+		mutex_lock(&ei->remap_lock);
+		moved = seq != ei->remap_seq;
+		mutex_unlock(&ei->remap_lock);
+	} while (moved);
+	if (err)
+		goto out;
+
+	kaddr = kmap_atomic(page);
+	memcpy(kaddr, out + (page->index - first) * PAGE_SIZE, PAGE_SIZE);
+	kunmap_atomic(kaddr);
+	flush_dcache_page(page);
+	ezfs_fill_chunk_pages(page->mapping, first, page->index, out);
+	SetPageUptodate(page);
+out:
+	if (err)
+		SetPageError(page);
+	kvfree(out);
+	unlock_page(page);
+	return err;
+}
+
+static int ezfs_compr_write_begin(struct file *file,
+		struct address_space *mapping, loff_t pos, unsigned len,
+		unsigned flags, struct page **pagep, void **fsdata)
+{
+	struct page *page;
+	int err;
+
+	if (pos + len > (loff_t) EZFS_MAX_CHUNKS * EZFS_CHUNK_SIZE)
+		return -EFBIG;
+	page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+	if (!page)
+		return -ENOMEM;
+	if (!PageUptodate(page) && len != PAGE_SIZE) {
+		err = ezfs_compr_readpage(file, page);
+		lock_page(page);
+		if (!err && !PageUptodate(page))
+			err = -EIO;
+		if (err) {
+			unlock_page(page);
+			put_page(page);
+			return err;
+		}
+	}
+	*pagep = page;
+	return 0;
+}
+
+// write a buffer to consecutive blocks through the buffer cache and wait
+static int ezfs_write_blocks(struct super_block *sb, uint64_t start,
+		const void *data, uint64_t count)
+{
+	struct buffer_head **bhs;
+	uint64_t i, n;
+	int err = 0;
+
+	bhs = kvcalloc(count, sizeof(*bhs), GFP_NOFS);
+	if (!bhs)
+		return -ENOMEM;
+	for (n = 0; n < count; n++) {
+		bhs[n] = sb_getblk(sb, start + n);
+		if (!bhs[n]) {
+			err = -ENOMEM;
+			break;
+		}
+		lock_buffer(bhs[n]);
+		memcpy(bhs[n]->b_data, data + n * EZFS_BLOCK_SIZE,
+				EZFS_BLOCK_SIZE);
+		set_buffer_uptodate(bhs[n]);
+		unlock_buffer(bhs[n]);
+		mark_buffer_dirty(bhs[n]);
+		write_dirty_buffer(bhs[n], 0);
+	}
+	for (i = 0; i < n; i++) {
+		wait_on_buffer(bhs[i]);
+		if (!buffer_uptodate(bhs[i]))
+			err = -EIO;
+		brelse(bhs[i]);
+	}
+	kvfree(bhs);
+	return err;
+}
+
+// buffers for writing back one chunk at a time
+struct ezfs_compr_ctx {
+	unsigned int algo;
+	void *in;	/* the chunk's data */
+	void *out;	/* the chunk compressed, or read back from disk */
+	void *ws;	/* compressor workspace */
+	struct page *pages[EZFS_CHUNK_BLOCKS];
+};
+
+static void ezfs_compr_ctx_free(struct ezfs_compr_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	kvfree(ctx->ws);
+	kvfree(ctx->out);
+	kvfree(ctx->in);
+	kfree(ctx);
+}
+
+static struct ezfs_compr_ctx *ezfs_compr_ctx_alloc(struct inode *inode)
+{
+	struct ezfs_compr_ctx *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_NOFS);
+	if (!ctx)
+		return NULL;
+	ctx->algo = ezfs_compr_algo(inode);
+	ctx->in = kvmalloc(EZFS_CHUNK_SIZE, GFP_NOFS);
+	ctx->out = kvmalloc(EZFS_CHUNK_SIZE, GFP_NOFS);
+	ctx->ws = kvmalloc(ezfs_compr_workspace_size(ctx->algo), GFP_NOFS);
+	if (!ctx->in || !ctx->out || !ctx->ws) {
+		ezfs_compr_ctx_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* How many blocks chunk c may take where it is: up to the next chunk, or to
+ * the end of the extent if it's the last one. *tail is set to the first
+ * block behind the last chunk.
+ */
+static uint64_t ezfs_chunk_slot(const struct ezfs_chunk *map,
+		uint64_t nblocks, uint64_t c, uint64_t *tail)
+{
+	uint64_t i, end = nblocks, last = 1;
+
+	for (i = 0; i < EZFS_MAX_CHUNKS; i++) {
+		if (!map[i].size)
+			continue;
+		last = max(last, map[i].offset + ezfs_chunk_blocks(&map[i]));
+		if (i != c && map[i].offset > map[c].offset)
+			end = min_t(uint64_t, end, map[i].offset);
+	}
+	*tail = min(last, nblocks);
+	return map[c].size && end > map[c].offset ? end - map[c].offset : 0;
+}
+
+/* Move the file to a new extent, with chunk c written from data and every
+ * other chunk copied over as it is, back to back. The chunks past nchunks
+ * are dropped. Called with remap_lock held.
+ */
+static int ezfs_compr_relocate(struct inode *inode, uint64_t c,
+		const struct ezfs_chunk *chunk, const void *data,
+		uint64_t nchunks)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_inode *di = inode->i_private;
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t old, old_count, new = 0, count, slack, used, moved = 0, n, i;
+	struct buffer_head *bh;
+	struct ezfs_chunk *map;
+	int err = 0;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	map = kzalloc(EZFS_BLOCK_SIZE, GFP_NOFS);
+	if (!map)
+		return -ENOMEM;
+	old = di->data_block_number;
+	old_count = di->nblocks;
+	if (old) {
+		bh = sb_bread(sb, old);
+		if (!bh) {
+			err = -EIO;
+			goto out;
+		}
+		memcpy(map, bh->b_data, EZFS_BLOCK_SIZE);
+		brelse(bh);
+	}
+	for (i = nchunks; i < EZFS_MAX_CHUNKS; i++)
+		memset(&map[i], 0, sizeof(map[i]));
+	map[c] = *chunk;
+
+	count = 1;
+	for (i = 0; i < nchunks; i++)
+		count += map[i].size ? ezfs_chunk_blocks(&map[i]) : 0;
+	// leave room to append without moving the file again
+	slack = min_t(uint64_t, count * sbh->opts.headroom / 100,
+			EZFS_MAX_DATA_BLKS - min_t(uint64_t, count,
+				EZFS_MAX_DATA_BLKS));
+	if (slack) {
+		ezfs_lock_sb(sbh);
+		new = ezfs_alloc_range(sbh, count + slack);
+		ezfs_unlock_sb(sbh);
+	}
+	if (new)
+		count += slack;
+	else
+		new = ezfs_alloc_range_wait(sbh, count);
+	if (!new) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	used = 1;
+	for (i = 0; i < nchunks && !err; i++) {
+		if (!map[i].size)
+			continue;
+		n = ezfs_chunk_blocks(&map[i]);
+		if (i == c) {
+			err = ezfs_write_blocks(sb, new + used, data, n);
+		} else {
+			err = ezfs_copy_blocks(sb, old + map[i].offset,
+					new + used, n);
+			moved += n;
+		}
+		map[i].offset = used;
+		used += n;
+	}
+	if (!err)
+		err = ezfs_write_blocks(sb, new, map, 1);
+	if (err) {
+		ezfs_lock_sb(sbh);
+		ezfs_free_blocks(ezfs_sb, new, count);
+		ezfs_unlock_sb(sbh);
+		goto out;
+	}
+	this_cpu_add(sbh->stats->blocks_relocated, moved);
+	this_cpu_add(sbh->stats->bytes_moved, moved * EZFS_BLOCK_SIZE);
+	trace_ezfs_relocate(inode, old, new, count);
+
+	ezfs_lock_sb(sbh);
+	di->data_block_number = new;
+	di->nblocks = count;
+	mark_buffer_dirty(sbh->i_store_bh);
+	mark_buffer_dirty(sbh->sb_bh);
+	ezfs_unlock_sb(sbh);
+	if (old && old_count)
+		ezfs_queue_reclaim(sbh, old, old_count);
+out:
+	kfree(map);
+	return err;
+}
+
+/* Compress size bytes of ctx->in and store them as chunk c: over the chunk's
+ * old blocks if it still fits there, else behind the last chunk, growing the
+ * extent in place if need be, and only as a last resort by moving the file.
+ * Called with remap_lock held.
+ */
+static int ezfs_compr_store_chunk(struct inode *inode, uint64_t c,
+		struct ezfs_compr_ctx *ctx, size_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_inode *di = inode->i_private;
+	uint64_t nchunks = DIV_ROUND_UP(i_size_read(inode), EZFS_CHUNK_SIZE);
+	uint64_t start = di->data_block_number, slot, tail, off = 0, nbl;
+	struct ezfs_chunk chunk, *map;
+	struct buffer_head *bh;
+	bool grown = false;
+	size_t clen;
+	void *data;
+	int err;
+
+	// readers that looked up the chunk before this have to look again
+	EZFS_I(inode)->remap_seq++;
+	// only worth it if the chunk gets at least a block smaller
+	clen = ezfs_compress(ctx->algo, ctx->ws, ctx->in, size, ctx->out,
+			size > EZFS_BLOCK_SIZE ? size - EZFS_BLOCK_SIZE : 0);
+	data = clen ? ctx->out : ctx->in;
+	chunk.length = clen;
+	chunk.size = size;
+	nbl = ezfs_chunk_blocks(&chunk);
+	memset(data + (clen ? clen : size), 0,
+			nbl * EZFS_BLOCK_SIZE - (clen ? clen : size));
+
+	if (!start)
+		return ezfs_compr_relocate(inode, c, &chunk, data,
+				max(nchunks, c + 1));
+	bh = sb_bread(sb, start);
+	if (!bh)
+		return -EIO;
+	map = (struct ezfs_chunk *) bh->b_data;
+	slot = ezfs_chunk_slot(map, di->nblocks, c, &tail);
+
+	ezfs_lock_sb(sbh);
+	if (nbl <= slot) {
+		off = map[c].offset;
+	} else if (slot && map[c].offset + slot == di->nblocks &&
+		   ezfs_extend_in_place(sbh, di, map[c].offset + nbl)) {
+		// the last chunk grows into the blocks behind the extent
+		off = map[c].offset;
+		grown = true;
+	} else if (di->nblocks - tail >= nbl) {
+		off = tail;
+	} else if (ezfs_extend_in_place(sbh, di, tail + nbl)) {
+		off = tail;
+		grown = true;
+	}
+	if (grown) {
+		mark_buffer_dirty(sbh->i_store_bh);
+		mark_buffer_dirty(sbh->sb_bh);
+	}
+	ezfs_unlock_sb(sbh);
+	if (!off) {
+		brelse(bh);
+		return ezfs_compr_relocate(inode, c, &chunk, data,
+				max(nchunks, c + 1));
+	}
+
+	err = ezfs_write_blocks(sb, start + off, data, nbl);
+	if (!err) {
+		chunk.offset = off;
+		lock_buffer(bh);
+		map[c] = chunk;
+		unlock_buffer(bh);
+		mark_buffer_dirty(bh);
+		err = sync_dirty_buffer(bh);
+	}
+	brelse(bh);
+	return err;
+}
+
+/* Write back chunk c of the file. Every cached page of the chunk is locked
+ * in index order and copied, and whatever isn't cached is read back from
+ * disk, so the chunk is always rewritten whole. locked is the page
+ * ->writepage was called for: it's locked and cleaned already, and as the
+ * other pages may only be trylocked around it, -EAGAIN means try later.
+ * *written counts the pages that were dirty.
+ */
+static int ezfs_compr_write_chunk(struct address_space *mapping, uint64_t c,
+		struct page *locked, struct ezfs_compr_ctx *ctx, long *written)
+{
+	struct inode *inode = mapping->host;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *di = inode->i_private;
+	pgoff_t first = c * EZFS_CHUNK_BLOCKS, idx, end;
+	loff_t isize = i_size_read(inode);
+	unsigned long have = 0, wb = 0;
+	struct page *page;
+	void *kaddr;
+	size_t size;
+	int i, err = 0;
+
+	end = min_t(pgoff_t, first + EZFS_CHUNK_BLOCKS,
+			DIV_ROUND_UP(isize, PAGE_SIZE));
+	// truncated away, or past what write_begin lets in
+	if (first >= end || c >= EZFS_MAX_CHUNKS) {
+		if (locked)
+			unlock_page(locked);
+		return first >= end ? 0 : -EFBIG;
+	}
+
+	memset(ctx->pages, 0, sizeof(ctx->pages));
+	for (idx = first; idx < end; idx++) {
+		if (locked && idx == locked->index) {
+			page = locked;
+			get_page(page);
+		} else if (locked) {
+			page = find_get_page(mapping, idx);
+			if (page && !trylock_page(page)) {
+				put_page(page);
+				err = -EAGAIN;
+				goto unlock;
+			}
+		} else {
+			page = find_lock_page(mapping, idx);
+		}
+		if (!page)
+			continue;
+		if (page->mapping != mapping) {
+			unlock_page(page);
+			put_page(page);
+			continue;
+		}
+		ctx->pages[idx - first] = page;
+		if (page != locked && PageWriteback(page)) {
+			if (locked) {
+				err = -EAGAIN;
+				goto unlock;
+			}
+			wait_on_page_writeback(page);
+		}
+	}
+
+	for (i = 0; i < EZFS_CHUNK_BLOCKS; i++) {
+		page = ctx->pages[i];
+		if (!page)
+			continue;
+		if (page == locked || clear_page_dirty_for_io(page)) {
+			set_page_writeback(page);
+			wb |= BIT(i);
+			(*written)++;
+		}
+		if (PageUptodate(page)) {
+			kaddr = kmap_atomic(page);
+			memcpy(ctx->in + i * PAGE_SIZE, kaddr, PAGE_SIZE);
+			kunmap_atomic(kaddr);
+			have |= BIT(i);
+		}
+		unlock_page(page);
+	}
+
+	size = min_t(loff_t, isize - first * PAGE_SIZE, EZFS_CHUNK_SIZE);
+	mutex_lock(&ei->remap_lock);
+	if (have != BIT(end - first) - 1) {
+		err = ezfs_read_chunk(inode, di->data_block_number,
+				di->nblocks, c, ctx->out);
+		for (i = 0; !err && i < end - first; i++)
+			if (!(have & BIT(i)))
+				memcpy(ctx->in + i * PAGE_SIZE,
+						ctx->out + i * PAGE_SIZE,
+						PAGE_SIZE);
+	}
+	if (!err) {
+		memset(ctx->in + size, 0, EZFS_CHUNK_SIZE - size);
+		err = ezfs_compr_store_chunk(inode, c, ctx, size);
+	}
+	mutex_unlock(&ei->remap_lock);
+
+	for (i = 0; i < EZFS_CHUNK_BLOCKS; i++) {
+		page = ctx->pages[i];
+		if (!page)
+			continue;
+		if (wb & BIT(i)) {
+			// keep the data dirty if it didn't make it to disk
+			if (err)
+				set_page_dirty(page);
+			end_page_writeback(page);
+		}
+		put_page(page);
+	}
+	if (err)
+		mapping_set_error(mapping, err);
+	return err;
+
+unlock:
+	for (i = 0; i < EZFS_CHUNK_BLOCKS; i++) {
+		page = ctx->pages[i];
+		if (!page)
+			continue;
+		if (page != locked)
+			unlock_page(page);
+		put_page(page);
+	}
+	return err;
+}
+
+static int ezfs_compr_writepage(struct page *page,
+		struct writeback_control *wbc)
+{
+	struct address_space *mapping = page->mapping;
+	struct ezfs_compr_ctx *ctx;
+	long written = 0;
+	int err = -ENOMEM;
+
+	ctx = ezfs_compr_ctx_alloc(mapping->host);
+	if (ctx)
+		err = ezfs_compr_write_chunk(mapping,
+				page->index / EZFS_CHUNK_BLOCKS, page, ctx,
+				&written);
+	ezfs_compr_ctx_free(ctx);
+	if (err == -EAGAIN || err == -ENOMEM) {
+		redirty_page_for_writepage(wbc, page);
+		unlock_page(page);
+		return 0;
+	}
+	return err;
+}
+
+/* Write back the dirty chunks in the range wbc asks for, one chunk at a
+ * time, and stop once nr_to_write pages are done unless this is for sync.
+ */
+static int ezfs_compr_writepages(struct address_space *mapping,
+		struct writeback_control *wbc)
+{
+	struct ezfs_compr_ctx *ctx;
+	struct pagevec pvec;
+	pgoff_t index, end, start;
+	uint64_t c, last = U64_MAX;
+	bool cycled = true, done = false;
+	xa_mark_t tag = PAGECACHE_TAG_DIRTY;
+	long written;
+	int i, n, err = 0;
+
+	if (!mapping_tagged(mapping, PAGECACHE_TAG_DIRTY))
+		return 0;
+	ctx = ezfs_compr_ctx_alloc(mapping->host);
+	if (!ctx)
+		return -ENOMEM;
+
+	if (wbc->range_cyclic) {
+		start = mapping->writeback_index;
+		end = -1;
+		cycled = !start;
+	} else {
+		start = wbc->range_start >> PAGE_SHIFT;
+		end = wbc->range_end >> PAGE_SHIFT;
+	}
+	if (wbc->sync_mode == WB_SYNC_ALL || wbc->tagged_writepages)
+		tag = PAGECACHE_TAG_TOWRITE;
+	// chunks are written whole, so start at the first page of one
+	index = round_down(start, EZFS_CHUNK_BLOCKS);
+retry:
+	if (tag == PAGECACHE_TAG_TOWRITE)
+		tag_pages_for_writeback(mapping, index, end);
+	pagevec_init(&pvec);
+	while (!done && index <= end) {
+		n = pagevec_lookup_range_tag(&pvec, mapping, &index, end, tag);
+		if (!n)
+			break;
+		for (i = 0; i < n; i++) {
+			c = pvec.pages[i]->index / EZFS_CHUNK_BLOCKS;
+			if (c == last)
+				continue;
+			last = c;
+			written = 0;
+			err = ezfs_compr_write_chunk(mapping, c, NULL, ctx,
+					&written);
+			wbc->nr_to_write -= written;
+			if (err || (wbc->nr_to_write <= 0 &&
+				    wbc->sync_mode == WB_SYNC_NONE)) {
+				done = true;
+				break;
+			}
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+	if (!cycled && !done) {
+		// wrap around to the part of the file before writeback_index
+		cycled = true;
+		index = 0;
+		end = start - 1;
+		goto retry;
+	}
+	if (wbc->range_cyclic)
+		mapping->writeback_index = done && last != U64_MAX ?
+			(last + 1) * EZFS_CHUNK_BLOCKS : 0;
+	ezfs_compr_ctx_free(ctx);
+	return err;
+}
+
+/* A truncate cut the file to size. Drop the chunks past it from the chunk
+ * map and rewrite the chunk it ends in at its new size, so that growing the
+ * file again reads zeroes and not the data that was cut off.
+ */
+static int ezfs_compr_truncate(struct inode *inode, loff_t size)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *di = inode->i_private;
+	uint64_t c = size / EZFS_CHUNK_SIZE, i;
+	struct ezfs_compr_ctx *ctx = NULL;
+	struct buffer_head *bh;
+	struct ezfs_chunk *map;
+	int err = 0;
+
+	if (size % EZFS_CHUNK_SIZE) {
+		ctx = ezfs_compr_ctx_alloc(inode);
+		if (!ctx)
+			return -ENOMEM;
+	}
+	mutex_lock(&ei->remap_lock);
+	if (!di->data_block_number)
+		goto out;
+	if (ctx) {
+		// pages still cached are newer and get written back on their own
+		err = ezfs_read_chunk(inode, di->data_block_number,
+				di->nblocks, c, ctx->in);
+		if (err)
+			goto out;
+		memset(ctx->in + size % EZFS_CHUNK_SIZE, 0,
+				EZFS_CHUNK_SIZE - size % EZFS_CHUNK_SIZE);
+		err = ezfs_compr_store_chunk(inode, c, ctx,
+				size % EZFS_CHUNK_SIZE);
+		if (err)
+			goto out;
+		c++;
+	}
+	bh = sb_bread(sb, di->data_block_number);
+	if (!bh) {
+		err = -EIO;
+		goto out;
+	}
+	map = (struct ezfs_chunk *) bh->b_data;
+	ei->remap_seq++;
+	lock_buffer(bh);
+	for (i = c; i < EZFS_MAX_CHUNKS; i++)
+		memset(&map[i], 0, sizeof(map[i]));
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	err = sync_dirty_buffer(bh);
+	brelse(bh);
+out:
+	mutex_unlock(&ei->remap_lock);
+	ezfs_compr_ctx_free(ctx);
+	return err;
+}
+
+/* write_begin only leaves a page unread when the write covers all of it,
+ * so a short copy into such a page has to be retried, not zeroed.
+ */
+static int ezfs_compr_write_end(struct file *file,
+		struct address_space *mapping, loff_t pos, unsigned len,
+		unsigned copied, struct page *page, void *fsdata)
+{
+	struct inode *inode = mapping->host;
+
+	if (!PageUptodate(page)) {
+		if (copied < len) {
+			copied = 0;
+			goto out;
+		}
+		SetPageUptodate(page);
+	}
+	set_page_dirty(page);
+	if (pos + copied > inode->i_size) {
+		i_size_write(inode, pos + copied);
+		mark_inode_dirty(inode);
+	}
+out:
+	unlock_page(page);
+	put_page(page);
+	return copied;
+}
+
+static const struct address_space_operations ezfs_compr_aops = {
+	.readpage	= ezfs_compr_readpage,
+	.writepage	= ezfs_compr_writepage,
+	.writepages	= ezfs_compr_writepages,
+	.set_page_dirty	= __set_page_dirty_nobuffers,
+	.write_begin	= ezfs_compr_write_begin,
+	.write_end	= ezfs_compr_write_end,
+};
+
+// files with no data yet follow the compress= mount option
+static void ezfs_init_compression(struct inode *inode)
+{
+	struct ezfs_sb_buffer_heads *sbh = inode->i_sb->s_fs_info;
+	struct ezfs_inode *di = inode->i_private;
+
+	if (!ezfs_compr_algo(inode) && !di->nblocks && sbh->opts.compress &&
+	    !sb_rdonly(inode->i_sb)) {
+		di->flags |= sbh->opts.compress;
+		mark_buffer_dirty(sbh->i_store_bh);
+	}
+	if (ezfs_compr_algo(inode))
+		inode->i_mapping->a_ops = &ezfs_compr_aops;
+}
+
+/* chattr +c/-c. The data layout only changes at the next writeback, so the
+ * switch is only allowed while the file holds no data.
+ */
+static int ezfs_set_compression(struct file *file, unsigned int flags)
+{
+	struct inode *inode = file_inode(file);
+	struct ezfs_sb_buffer_heads *sbh = inode->i_sb->s_fs_info;
+	struct ezfs_inode *di = inode->i_private;
+	unsigned int algo = EZFS_COMPR_NONE;
+	int err;
+
+	if (flags & ~FS_COMPR_FL)
+		return -EOPNOTSUPP;
+	if (!inode_owner_or_capable(inode))
+		return -EACCES;
+	if (flags && !S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (flags)
+		algo = sbh->opts.compress ? sbh->opts.compress : EZFS_COMPR_LZ4;
+
+	err = mnt_want_write_file(file);
+	if (err)
+		return err;
+	inode_lock(inode);
+	if (algo == ezfs_compr_algo(inode))
+		goto out;
+	if (i_size_read(inode) || di->nblocks) {
+		err = -EBUSY;
+		goto out;
+	}
+	truncate_inode_pages(inode->i_mapping, 0);
+	di->flags = (di->flags & ~EZFS_INODE_COMPR_MASK) | algo;
+	inode->i_mapping->a_ops = algo ? &ezfs_compr_aops : &ezfs_aops;
+	mark_buffer_dirty(sbh->i_store_bh);
+out:
+	inode_unlock(inode);
+	mnt_drop_write_file(file);
+	return err;
+}
+
+/* Discard every run of at least minlen free blocks inside the range. Each run
+ * is marked in use while its discard is in flight so the allocator skips it,
+ * and ezfs_lock is never held across the I/O.
+ */
+static int ezfs_trim_fs(struct super_block *sb, struct fstrim_range *range)
+{
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t first, last, minlen, blk, run, count, i, trimmed = 0;
+	int err = 0;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	first = max_t(uint64_t, range->start >> sb->s_blocksize_bits,
+			EZFS_ROOT_DATABLOCK_NUMBER);
+	last = EZFS_ROOT_DATABLOCK_NUMBER + EZFS_MAX_DATA_BLKS - 1;
+	last = min_t(uint64_t, last,
+			(i_size_read(sb->s_bdev->bd_inode) >>
+			 sb->s_blocksize_bits) - 1);
+	if (range->len < ULLONG_MAX - range->start)
+		last = min_t(uint64_t, last, (range->start + range->len - 1) >>
+				sb->s_blocksize_bits);
+	minlen = max_t(uint64_t, range->minlen >> sb->s_blocksize_bits, 1);
+
+	blk = first;
+	while (blk <= last) {
+		ezfs_lock_sb(sbh);
+		while (blk <= last &&
+		       IS_SET(ezfs_sb->free_data_blocks, EZFS_DATA_BIT(blk)))
+			blk++;
+		run = blk;
+		while (blk <= last &&
+		       !IS_SET(ezfs_sb->free_data_blocks, EZFS_DATA_BIT(blk)))
+			blk++;
+		count = blk - run;
+		if (count < minlen) {
+			ezfs_unlock_sb(sbh);
+			continue;
+		}
+		for (i = run; i < blk; i++)
+			SETBIT(ezfs_sb->free_data_blocks, EZFS_DATA_BIT(i));
+		ezfs_unlock_sb(sbh);
+
+		err = sb_issue_discard(sb, run, count, GFP_NOFS, 0);
+
+		ezfs_lock_sb(sbh);
+		ezfs_free_blocks(ezfs_sb, run, count);
+		ezfs_unlock_sb(sbh);
+		if (err)
+			break;
+		trimmed += count;
+
+		if (fatal_signal_pending(current)) {
+			err = -ERESTARTSYS;
+			break;
+		}
+		cond_resched();
+	}
+
+	range->len = trimmed << sb->s_blocksize_bits;
+	return err;
+}
+
+static long ezfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct super_block *sb = file_inode(filp)->i_sb;
+	struct request_queue *q = bdev_get_queue(sb->s_bdev);
+	struct fstrim_range __user *urange = (void __user *) arg;
+	struct fstrim_range range;
+	int err, flags;
+
+	switch (cmd) {
+	case FS_IOC_GETFLAGS:
+		flags = ezfs_compr_algo(file_inode(filp)) ? FS_COMPR_FL : 0;
+		return put_user(flags, (int __user *) arg);
+	case FS_IOC_SETFLAGS:
+		if (get_user(flags, (int __user *) arg))
+			return -EFAULT;
+		return ezfs_set_compression(filp, flags);
+	case FITRIM:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (sb_rdonly(sb))
+			return -EROFS;
+		if (!blk_queue_discard(q))
+			return -EOPNOTSUPP;
+		if (copy_from_user(&range, urange, sizeof(range)))
+			return -EFAULT;
+		range.minlen = max_t(uint64_t, range.minlen,
+				q->limits.discard_granularity);
+		err = ezfs_trim_fs(sb, &range);
+		if (err)
+			return err;
+		if (copy_to_user(urange, &range, sizeof(range)))
+			return -EFAULT;
+		return 0;
+	}
+	return -ENOTTY;
+}
+
+/* Point the buffers cached for the file's pages at its new extent. The
+ * pages were written back first, so only the block numbers need to change.
+ */
+static void ezfs_remap_page_buffers(struct inode *inode, uint64_t old,
+		uint64_t new)
+{
+	struct address_space *mapping = inode->i_mapping;
+	struct buffer_head *bh, *head;
+	struct pagevec pvec;
+	pgoff_t index = 0;
+	int i;
+
+	pagevec_init(&pvec);
+	while (pagevec_lookup(&pvec, mapping, &index)) {
+		for (i = 0; i < pagevec_count(&pvec); i++) {
+			struct page *page = pvec.pages[i];
+
+			lock_page(page);
+			if (page->mapping == mapping && page_has_buffers(page)) {
+				bh = head = page_buffers(page);
+				do {
+					if (buffer_mapped(bh))
+						bh->b_blocknr += new - old;
+					bh = bh->b_this_page;
+				} while (bh != head);
+			}
+			unlock_page(page);
+		}
+		pagevec_release(&pvec);
+		cond_resched();
+	}
+}
+
+/* Move the file to a new extent of count blocks, copying its data over and
+ * pointing the page cache at the new blocks. The old blocks go to the reclaim
+ * worker, which only drops our share of them if they're reflinked. Called
+ * with remap_lock held and no page of the file locked.
+ */
+static int ezfs_relocate_extent(struct inode *inode, uint64_t count)
+{
+	struct super_block *sb = inode->i_sb;
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_inode *di = inode->i_private;
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t old, old_count, new;
+	int err;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+
+	old = di->data_block_number;
+	old_count = old ? di->nblocks : 0;
+	new = ezfs_alloc_range_wait(sbh, count);
+	if (!new)
+		return -ENOSPC;
+
+	if (old_count) {
+		err = filemap_write_and_wait(inode->i_mapping);
+		if (!err)
+			err = ezfs_copy_blocks(sb, old, new,
+					min(old_count, count));
+		if (err) {
+			ezfs_lock_sb(sbh);
+			ezfs_free_blocks(ezfs_sb, new, count);
+			ezfs_unlock_sb(sbh);
+			return err;
+		}
+		ezfs_remap_page_buffers(inode, old, new);
+		this_cpu_add(sbh->stats->blocks_relocated,
+				min(old_count, count));
+		this_cpu_add(sbh->stats->bytes_moved,
+				min(old_count, count) * EZFS_BLOCK_SIZE);
+	}
+	trace_ezfs_relocate(inode, old, new, count);
+
+	ezfs_lock_sb(sbh);
+	di->data_block_number = new;
+	di->nblocks = count;
+	mark_buffer_dirty(sbh->i_store_bh);
+	mark_buffer_dirty(sbh->sb_bh);
+	ezfs_unlock_sb(sbh);
+	if (old_count)
+		ezfs_queue_reclaim(sbh, old, old_count);
+	return 0;
+}
+
+/* Make the file's extent at least want blocks long, in place if the blocks
+ * right behind it are free and by relocating it otherwise. Called with
+ * inode_lock held, which also keeps the extent from shrinking, so an extent
+ * that is already long enough needs no other lock.
+ */
+static int ezfs_grow_extent(struct inode *inode, uint64_t want)
+{
+	struct ezfs_sb_buffer_heads *sbh = inode->i_sb->s_fs_info;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *di = inode->i_private;
+	uint64_t slack;
+	int err = 0;
+
+	if (want > EZFS_MAX_DATA_BLKS)
+		return -EFBIG;
+	if (READ_ONCE(di->nblocks) >= want)
+		return 0;
+	// take some slack up front so the next appends don't move the file
+	slack = min_t(uint64_t, want * sbh->opts.headroom / 100,
+			EZFS_MAX_DATA_BLKS - want);
+
+	mutex_lock(&ei->remap_lock);
+	ezfs_lock_sb(sbh);
+	if (di->nblocks >= want) {
+		ezfs_unlock_sb(sbh);
+		goto out;
+	}
+	if (di->data_block_number &&
+	    (ezfs_extend_in_place(sbh, di, want + slack) ||
+	     ezfs_extend_in_place(sbh, di, want))) {
+		mark_buffer_dirty(sbh->i_store_bh);
+		mark_buffer_dirty(sbh->sb_bh);
+		ezfs_unlock_sb(sbh);
+		goto out;
+	}
+	ezfs_unlock_sb(sbh);
+	err = ezfs_relocate_extent(inode, want + slack);
+	if (err == -ENOSPC && slack)
+		err = ezfs_relocate_extent(inode, want);
+out:
+	mutex_unlock(&ei->remap_lock);
+	return err;
+}
+
+/* Copy-on-write for reflinked files. Every file is one contiguous extent,
+ * so the first write after a clone moves the whole extent to blocks of its
+ * own. This runs before the write reaches ezfs_get_block: the page cache
+ * already maps the old blocks, and get_block can't fix those mappings while
+ * the caller holds a page lock.
+ */
+static int ezfs_unshare_extent(struct inode *inode)
+{
+	struct ezfs_sb_buffer_heads *sbh = inode->i_sb->s_fs_info;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *di = inode->i_private;
+	struct ezfs_super_block *ezfs_sb;
+	bool shared;
+	int err = 0;
+
+	// set when the file is loaded or cloned, cleared once it's checked
+	if (!test_bit(EZFS_I_SHARED, &ei->state))
+		return 0;
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+
+	mutex_lock(&ei->remap_lock);
+	ezfs_lock_sb(sbh);
+	shared = di->data_block_number && ezfs_range_shared(ezfs_sb,
+			di->data_block_number, di->nblocks);
+	ezfs_unlock_sb(sbh);
+	if (shared)
+		err = ezfs_relocate_extent(inode, di->nblocks);
+	if (!err)
+		clear_bit(EZFS_I_SHARED, &ei->state);
+	mutex_unlock(&ei->remap_lock);
+	return err;
+}
+
+/* A write starting past EOF, or a truncate that extends the file, leaves
+ * whole blocks between the old end of the file and pos. They may hold stale
+ * data from a previous owner and readers map them, so zero them on the
+ * device.
+ */
+static int ezfs_zero_gap(struct inode *inode, loff_t pos)
+{
+	struct ezfs_inode *di = inode->i_private;
+	sector_t first = DIV_ROUND_UP(i_size_read(inode), EZFS_BLOCK_SIZE);
+	sector_t last = pos >> inode->i_blkbits;
+
+	if (first >= last)
+		return 0;
+	return sb_issue_zeroout(inode->i_sb, di->data_block_number + first,
+			last - first, GFP_NOFS);
+}
+
+/* Cut the extent down to its first keep blocks and hand the rest to the
+ * reclaim worker. The page cache past them must be gone already.
+ */
+static void ezfs_trim_extent(struct inode *inode, uint64_t keep)
+{
+	struct ezfs_sb_buffer_heads *sbh = inode->i_sb->s_fs_info;
+	struct ezfs_inode_info *ei = EZFS_I(inode);
+	struct ezfs_inode *di = inode->i_private;
+	uint64_t start = 0, count = 0;
+
+	mutex_lock(&ei->remap_lock);
+	ezfs_lock_sb(sbh);
+	if (di->data_block_number && di->nblocks > keep) {
+		start = di->data_block_number + keep;
+		count = di->nblocks - keep;
+		di->nblocks = keep;
+		if (!keep)
+			di->data_block_number = 0;
+		mark_buffer_dirty(sbh->i_store_bh);
+	}
+	ezfs_unlock_sb(sbh);
+	mutex_unlock(&ei->remap_lock);
+	if (count)
+		ezfs_queue_reclaim(sbh, start, count);
+}
+
+/* The headroom a file was given to grow into is only worth keeping while
+ * the file is in use, so ezfs_evict_inode gives back what it didn't fill.
+ * A compressed file keeps its chunks up to the last one.
+ */
+static void ezfs_trim_slack(struct inode *inode)
+{
+	struct ezfs_inode *di = inode->i_private;
+	uint64_t keep = DIV_ROUND_UP(i_size_read(inode), EZFS_BLOCK_SIZE);
+	struct buffer_head *bh;
+
+	if (!di->data_block_number)
+		return;
+	if (ezfs_compr_algo(inode)) {
+		bh = sb_bread(inode->i_sb, di->data_block_number);
+		if (!bh)
+			return;
+		ezfs_chunk_slot((struct ezfs_chunk *) bh->b_data, di->nblocks,
+				0, &keep);
+		brelse(bh);
+	}
+	ezfs_trim_extent(inode, keep);
+}
+
+static ssize_t ezfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct ezfs_inode *di = inode->i_private;
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+	ret = ezfs_unshare_extent(inode);
+	if (ret)
+		goto out;
+	// get_block only maps blocks inside the extent, so make room first
+	if (!(di->flags & EZFS_INODE_COMPR_MASK)) {
+		ret = ezfs_grow_extent(inode, DIV_ROUND_UP(iocb->ki_pos +
+				iov_iter_count(from), EZFS_BLOCK_SIZE));
+		if (ret)
+			goto out;
+		ret = ezfs_zero_gap(inode, iocb->ki_pos);
+		if (ret)
+			goto out;
+	}
+	ret = __generic_file_write_iter(iocb, from);
+out:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+/* Keep the extent covering i_size. An extending truncate grows the extent
+ * and zeroes the new blocks, like a write past EOF would, so neither reads
+ * nor mmap writeback find blocks the file doesn't own. A shrinking one zeroes
+ * the tail of the new last block, so extending the file again later doesn't
+ * bring back what was cut off, and gives the blocks past it back. Compressed
+ * files read holes as zeroes and only need their chunk map cut down, by
+ * ezfs_compr_truncate.
+ */
+static int ezfs_setattr(struct dentry *dentry, struct iattr *iattr)
+{
+	struct inode *inode = d_inode(dentry);
+	struct ezfs_inode *di = inode->i_private;
+	loff_t size = iattr->ia_size;
+	bool shrink;
+	int err;
+
+	err = setattr_prepare(dentry, iattr);
+	if (err)
+		return err;
+	shrink = size < i_size_read(inode);
+
+	if ((iattr->ia_valid & ATTR_SIZE) && size != i_size_read(inode) &&
+	    !(di->flags & EZFS_INODE_COMPR_MASK)) {
+		err = ezfs_unshare_extent(inode);
+		if (err)
+			return err;
+		if (!shrink) {
+			err = ezfs_grow_extent(inode,
+					DIV_ROUND_UP(size, EZFS_BLOCK_SIZE));
+			if (!err)
+				err = ezfs_zero_gap(inode,
+						round_up(size, EZFS_BLOCK_SIZE));
+		} else {
+			err = block_truncate_page(inode->i_mapping, size,
+					ezfs_get_block);
+		}
+		if (err)
+			return err;
+	}
+	if (iattr->ia_valid & ATTR_SIZE) {
+		truncate_setsize(inode, size);
+		if (shrink && (di->flags & EZFS_INODE_COMPR_MASK)) {
+			err = ezfs_compr_truncate(inode, size);
+			if (err)
+				return err;
+		} else if (shrink) {
+			ezfs_trim_extent(inode,
+					DIV_ROUND_UP(size, EZFS_BLOCK_SIZE));
+		}
+	}
+	setattr_copy(inode, iattr);
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+static vm_fault_t ezfs_page_mkwrite(struct vm_fault *vmf)
+{
+	int err;
+
+	err = ezfs_unshare_extent(file_inode(vmf->vma->vm_file));
+	if (err)
+		return vmf_error(err);
+	return filemap_page_mkwrite(vmf);
+}
+
+static const struct vm_operations_struct ezfs_file_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= ezfs_page_mkwrite,
+};
+
+static int ezfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &ezfs_file_vm_ops;
+	return 0;
+}
+
+// take two files' remap_locks in the order lock_two_nondirectories uses
+static void ezfs_lock_two_remaps(struct inode *a, struct inode *b)
+{
+	if (a > b)
+		swap(a, b);
+	mutex_lock(&EZFS_I(a)->remap_lock);
+	mutex_lock_nested(&EZFS_I(b)->remap_lock, SINGLE_DEPTH_NESTING);
+}
+
+static void ezfs_unlock_two_remaps(struct inode *a, struct inode *b)
+{
+	mutex_unlock(&EZFS_I(a)->remap_lock);
+	mutex_unlock(&EZFS_I(b)->remap_lock);
+}
+
+/* FICLONE/FICLONERANGE. A file is a single extent, so only a clone of the
+ * whole source file onto the start of a destination no longer than it can
+ * share blocks. Anything else returns -EOPNOTSUPP and cp falls back to
+ * copying.
+ */
+static loff_t ezfs_remap_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, loff_t len,
+		unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct ezfs_sb_buffer_heads *sbh = src->i_sb->s_fs_info;
+	struct ezfs_inode *src_di = src->i_private;
+	struct ezfs_inode *dst_di = dst->i_private;
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t start, count, old, old_count, i;
+	loff_t ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_CAN_SHORTEN |
+			    REMAP_FILE_ADVISORY))
+		return -EINVAL;
+	if (remap_flags & REMAP_FILE_DEDUP)
+		return -EOPNOTSUPP;
+	if (src == dst)
+		return -EINVAL;
+	if (ezfs_compr_algo(src) || ezfs_compr_algo(dst))
+		return -EOPNOTSUPP;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	lock_two_nondirectories(src, dst);
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+			&len, remap_flags);
+	if (ret < 0 || len == 0)
+		goto out_unlock;
+
+	ret = -EOPNOTSUPP;
+	if (pos_in || pos_out || len != i_size_read(src) ||
+	    i_size_read(dst) > len)
+		goto out_unlock;
+	ret = -ETXTBSY;
+	if (mapping_writably_mapped(src->i_mapping) ||
+	    mapping_writably_mapped(dst->i_mapping))
+		goto out_unlock;
+
+	ezfs_lock_two_remaps(src, dst);
+	truncate_pagecache(dst, 0);
+
+	ezfs_lock_sb(sbh);
+	start = src_di->data_block_number;
+	count = DIV_ROUND_UP(len, src->i_sb->s_blocksize);
+	for (i = start; i < start + count; i++) {
+		if (ezfs_sb->block_shares[EZFS_DATA_BIT(i)] ==
+		    EZFS_MAX_BLOCK_SHARES) {
+			ezfs_unlock_sb(sbh);
+			ezfs_unlock_two_remaps(src, dst);
+			ret = -EMLINK;
+			goto out_unlock;
+		}
+	}
+	for (i = start; i < start + count; i++)
+		ezfs_sb->block_shares[EZFS_DATA_BIT(i)]++;
+	old = dst_di->data_block_number;
+	old_count = dst_di->nblocks;
+	dst_di->data_block_number = start;
+	dst_di->nblocks = count;
+	dst_di->file_size = len;
+	mark_buffer_dirty(sbh->i_store_bh);
+	mark_buffer_dirty(sbh->sb_bh);
+	ezfs_unlock_sb(sbh);
+	set_bit(EZFS_I_SHARED, &EZFS_I(src)->state);
+	set_bit(EZFS_I_SHARED, &EZFS_I(dst)->state);
+	ezfs_unlock_two_remaps(src, dst);
+
+	if (old && old_count)
+		ezfs_queue_reclaim(sbh, old, old_count);
+	i_size_write(dst, len);
+	dst->i_mtime = dst->i_ctime = current_time(dst);
+	mark_inode_dirty(dst);
+	ret = len;
+
+out_unlock:
+	unlock_two_nondirectories(src, dst);
+	return ret;
+}
+
+/* Copy whole blocks from one file to another on the device. The range has
+ * to start on block boundaries in both files; a partial last block is only
+ * copied when it is the end of the source and becomes the end of the
+ * destination, so nothing past EOF can show through. Returns the number of
+ * bytes copied, or 0 when the caller should fall back to splicing.
+ */
+static ssize_t ezfs_copy_extent_range(struct inode *src, loff_t pos_in,
+		struct inode *dst, loff_t pos_out, size_t len)
+{
+	struct super_block *sb = src->i_sb;
+	struct ezfs_inode *src_di = src->i_private;
+	struct ezfs_inode *dst_di = dst->i_private;
+	unsigned int bits = sb->s_blocksize_bits;
+	loff_t isize = i_size_read(src);
+	uint64_t first, count;
+	ssize_t copied;
+	int err;
+
+	// newly grown blocks aren't zeroed, so leave gaps to the write path
+	if (pos_in >= isize || pos_out > i_size_read(dst))
+		return 0;
+	len = min_t(loff_t, len, isize - pos_in);
+	count = len >> bits;
+	if (pos_in + len == isize && pos_out + len >= i_size_read(dst))
+		count = DIV_ROUND_UP(len, sb->s_blocksize);
+	first = pos_in >> bits;
+	// blocks past the end of the source extent are holes
+	if (first >= src_di->nblocks)
+		return 0;
+	count = min(count, src_di->nblocks - first);
+	if (!count)
+		return 0;
+	copied = min_t(loff_t, len, count << bits);
+
+	err = filemap_write_and_wait_range(src->i_mapping, pos_in,
+			pos_in + copied - 1);
+	if (!err)
+		err = ezfs_unshare_extent(dst);
+	if (!err)
+		err = ezfs_grow_extent(dst, (pos_out >> bits) + count);
+	if (!err)
+		err = filemap_write_and_wait_range(dst->i_mapping, pos_out,
+				pos_out + copied - 1);
+	if (!err)
+		err = invalidate_inode_pages2_range(dst->i_mapping,
+				pos_out >> PAGE_SHIFT,
+				(pos_out + copied - 1) >> PAGE_SHIFT);
+	if (err)
+		return err;
+
+	// growing dst may have moved src too when both are the same file
+	err = ezfs_copy_blocks(sb, src_di->data_block_number + first,
+			dst_di->data_block_number + (pos_out >> bits), count);
+	if (err)
+		return err;
+
+	if (pos_out + copied > i_size_read(dst))
+		i_size_write(dst, pos_out + copied);
+	dst->i_mtime = dst->i_ctime = current_time(dst);
+	mark_inode_dirty(dst);
+	return copied;
+}
+
+static ssize_t ezfs_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	ssize_t ret = 0;
+
+	if (src->i_sb == dst->i_sb &&
+	    !ezfs_compr_algo(src) && !ezfs_compr_algo(dst) &&
+	    IS_ALIGNED(pos_in | pos_out, src->i_sb->s_blocksize)) {
+		lock_two_nondirectories(src, dst);
+		ret = file_modified(file_out);
+		if (!ret)
+			ret = ezfs_copy_extent_range(src, pos_in, dst, pos_out,
+					len);
+		unlock_two_nondirectories(src, dst);
+	}
+	if (ret)
+		return ret;
+	return generic_copy_file_range(file_in, pos_in, file_out, pos_out,
+			len, flags);
+}
+
+#ifdef CONFIG_COMPAT
+static long ezfs_compat_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	switch (cmd) {
+	case FS_IOC32_GETFLAGS:
+		cmd = FS_IOC_GETFLAGS;
+		break;
+	case FS_IOC32_SETFLAGS:
+		cmd = FS_IOC_SETFLAGS;
+		break;
+	}
+	return ezfs_ioctl(filp, cmd, (unsigned long) compat_ptr(arg));
+}
+#endif
+
+const struct inode_operations ezfs_dir_inode_ops = {
+	//.create = ezfs_create,
+	.lookup	= ezfs_lookup,
+	.link	= simple_link,
+	.unlink = ezfs_unlink,
+	.rename = simple_rename,
+};
+
+const struct inode_operations ezfs_file_inode_ops = {
+	.setattr = ezfs_setattr,
+	.getattr = simple_getattr,
+};
+
+const struct file_operations ezfs_file_ops = {
+	.read_iter  	= generic_file_read_iter,
+	.write_iter 	= ezfs_file_write_iter,
+	.llseek    	= generic_file_llseek,
+	.mmap	    	= ezfs_file_mmap,
+	.remap_file_range = ezfs_remap_file_range,
+	.splice_read	= generic_file_splice_read,
+	.splice_write	= iter_file_splice_write,
+	.copy_file_range = ezfs_copy_file_range,
+	.unlocked_ioctl	= ezfs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= ezfs_compat_ioctl,
+#endif
+};
+
+const struct file_operations ezfs_dir_file_ops = {
 	.read		= generic_read_dir,
 	.read_iter	= generic_file_read_iter,
 	.iterate_shared	= ezfs_readdir,
 	.fsync		= generic_file_fsync,
 	.llseek		= generic_file_llseek,
+	.unlocked_ioctl	= ezfs_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl	= ezfs_compat_ioctl,
+#endif
 };
 
 static sector_t ezfs_bmap(struct address_space *mapping, sector_t block)
 {
+	// compressed files have no block that maps 1:1 to the data
+	if (ezfs_compr_algo(mapping->host))
+		return 0;
 	return generic_block_bmap(mapping, block, ezfs_get_block);
 }
 
 static const struct address_space_operations ezfs_aops = {
 	.readpage 	= ezfs_readpage,
+	.readahead	= ezfs_readahead,
 	.writepage	= ezfs_writepage,
+	.writepages	= ezfs_writepages,
 	.write_begin	= ezfs_write_begin,
 	.write_end	= generic_write_end,
 	.bmap		= ezfs_bmap,
@@ -466,9 +2540,9 @@ static const struct address_space_operations ezfs_aops = {
 struct inode *ezfs_get_inode(struct super_block *sb,
 		const struct inode *dir, unsigned long ino)
 {
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
 	struct inode *inode;
 	struct ezfs_inode *ezfs_inode;
-	struct buffer_head *bh;
 	int offset;
 	umode_t mode;
 	inode = iget_locked(sb, ino);
@@ -476,29 +2550,38 @@ struct inode *ezfs_get_inode(struct super_block *sb,
 		return ERR_PTR(-ENOMEM);
 	if (!(inode->i_state & I_NEW))
 		return inode;
-	bh = sb_bread(inode->i_sb, EZFS_INODE_STORE_DATABLOCK_NUMBER);
-	if (!bh)
-		return ERR_PTR(-EIO);
+	// the inode store stays pinned in i_store_bh for the whole mount
 	offset = ino - EZFS_ROOT_INODE_NUMBER;
-	ezfs_inode = (struct ezfs_inode *) bh->b_data + offset;
+	ezfs_inode = (struct ezfs_inode *) sbh->i_store_bh->b_data + offset;
 	mode = ezfs_inode->mode;
+	// eviction would free an inode a directory still points to
+	if (!ezfs_inode->nlink) {
+		iget_failed(inode);
+		return ERR_PTR(-EIO);
+	}
 
 	if (inode) {
-		inode_init_owner(inode, dir, mode);
+		// owner and times are what ezfs_write_inode last stored
+		inode->i_mode = mode;
+		i_uid_write(inode, ezfs_inode->uid);
+		i_gid_write(inode, ezfs_inode->gid);
+		inode->i_atime = ezfs_inode->i_atime;
+		inode->i_mtime = ezfs_inode->i_mtime;
+		inode->i_ctime = ezfs_inode->i_ctime;
 		inode->i_mapping->a_ops = &ezfs_aops;
-		inode->i_atime = inode->i_mtime = inode->i_ctime =
-			current_time(inode);
 		inode->i_private = ezfs_inode;
 		inode->i_size = ezfs_inode->file_size;
-		if (mode == (S_IFDIR | 0777)) {
-			inode->i_mode |= S_IFDIR;
+		set_nlink(inode, ezfs_inode->nlink);
+		if (S_ISDIR(mode)) {
 			inode->i_op = &ezfs_dir_inode_ops;
 			inode->i_fop = &ezfs_dir_file_ops;
-			inc_nlink(inode);
-		} else if (mode == (S_IFREG | 0666)) {
-			inode->i_mode |= S_IFREG;
+		} else if (S_ISREG(mode)) {
 			inode->i_op = &ezfs_file_inode_ops;
 			inode->i_fop = &ezfs_file_ops;
+			ezfs_init_compression(inode);
+			// the first write checks whether it is still reflinked
+			if (!sbh->packed)
+				set_bit(EZFS_I_SHARED, &EZFS_I(inode)->state);
 		}
 		inode->i_private = ezfs_inode;
 	}
@@ -507,51 +2590,224 @@ struct inode *ezfs_get_inode(struct super_block *sb,
 
 }
 
+static void ezfs_check_discard(struct super_block *sb,
+		struct ezfs_mount_opts *opts)
+{
+	if (opts->discard &&
+	    !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+		pr_warn("ezfs: %s does not support discard, disabling it\n",
+				sb->s_id);
+		opts->discard = false;
+	}
+}
+
+/* With -o commit=N, dirty inodes, the bitmaps and the inode table are
+ * written back every N seconds instead of whenever writeback gets to them.
+ */
+static void ezfs_commit_worker(struct work_struct *work)
+{
+	struct ezfs_sb_buffer_heads *sbh = container_of(to_delayed_work(work),
+			struct ezfs_sb_buffer_heads, commit_work);
+
+	try_to_writeback_inodes_sb(sbh->sb, WB_REASON_PERIODIC);
+	sync_dirty_buffer(sbh->sb_bh);
+	sync_dirty_buffer(sbh->i_store_bh);
+	if (sbh->opts.commit && !sb_rdonly(sbh->sb))
+		queue_delayed_work(system_unbound_wq, &sbh->commit_work,
+				sbh->opts.commit * HZ);
+}
+
+// add up every CPU's counters
+static void ezfs_stats_sum(struct ezfs_sb_buffer_heads *sbh,
+		struct ezfs_stats *sum)
+{
+	struct ezfs_stats *st;
+	int cpu, i;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(sbh->stats, cpu);
+		sum->blocks_relocated += st->blocks_relocated;
+		sum->bytes_moved += st->bytes_moved;
+		sum->lookups += st->lookups;
+		sum->lookup_probes += st->lookup_probes;
+		sum->allocs += st->allocs;
+		sum->alloc_scanned += st->alloc_scanned;
+		for (i = 0; i < EZFS_HIST_BUCKETS; i++) {
+			sum->lock_wait[i] += st->lock_wait[i];
+			sum->lock_hold[i] += st->lock_hold[i];
+		}
+	}
+}
+
+static void ezfs_show_hist(struct seq_file *m, const char *name,
+		const u64 *hist)
+{
+	int i;
+
+	seq_printf(m, "%s:", name);
+	for (i = 0; i < EZFS_HIST_BUCKETS; i++)
+		seq_printf(m, " %llu", hist[i]);
+	seq_putc(m, '\n');
+}
+
+static int ezfs_stats_show(struct seq_file *m, void *v)
+{
+	struct ezfs_sb_buffer_heads *sbh = m->private;
+	struct ezfs_stats st;
+
+	ezfs_stats_sum(sbh, &st);
+	seq_printf(m, "blocks_relocated: %llu\n", st.blocks_relocated);
+	seq_printf(m, "bytes_moved: %llu\n", st.bytes_moved);
+	seq_printf(m, "lookups: %llu\n", st.lookups);
+	seq_printf(m, "lookup_probes: %llu\n", st.lookup_probes);
+	seq_printf(m, "allocs: %llu\n", st.allocs);
+	seq_printf(m, "alloc_scanned: %llu\n", st.alloc_scanned);
+	ezfs_show_hist(m, "lock_wait_us", st.lock_wait);
+	ezfs_show_hist(m, "lock_hold_us", st.lock_hold);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ezfs_stats);
+
+static inline uint64_t ezfs_dev_blocks(struct super_block *sb)
+{
+	return i_size_read(sb->s_bdev->bd_inode) >> sb->s_blocksize_bits;
+}
+
+/* Cheap checks of the superblock before the mount trusts it. Blocks past
+ * the end of the device must be marked used, as the formatter leaves them,
+ * or the allocator would hand them out. Anything deeper is for fsck.ezfs.
+ */
+static int ezfs_check_super(struct super_block *sb, struct fs_context *fc)
+{
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_super_block *ezfs_sb;
+	uint64_t nblocks = ezfs_dev_blocks(sb), k;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	if (ezfs_sb->magic != EZFS_MAGIC_NUMBER)
+		return invalfc(fc, "%s is not an ezfs volume", sb->s_id);
+	if (ezfs_sb->version != 1)
+		return invalfc(fc, "%s: unsupported version %llu", sb->s_id,
+				ezfs_sb->version);
+	if (ezfs_sb->flags & ~EZFS_SB_PACKED)
+		return invalfc(fc, "%s: unknown flags %#llx", sb->s_id,
+				ezfs_sb->flags);
+	if (nblocks <= EZFS_ROOT_DATABLOCK_NUMBER)
+		return invalfc(fc, "%s is too small", sb->s_id);
+	for (k = EZFS_DATA_BIT(nblocks); k < EZFS_MAX_DATA_BLKS; k++)
+		if (!IS_SET(ezfs_sb->free_data_blocks, k))
+			return invalfc(fc, "%s: free blocks past the end of the device, run fsck.ezfs",
+					sb->s_id);
+	return 0;
+}
+
+// the root directory is read right away, so it has to make sense
+static int ezfs_check_root(struct super_block *sb, struct fs_context *fc)
+{
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_super_block *ezfs_sb;
+	struct ezfs_inode *root;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	root = (struct ezfs_inode *) sbh->i_store_bh->b_data +
+		EZFS_INODE_BIT(EZFS_ROOT_INODE_NUMBER);
+	if (!IS_SET(ezfs_sb->free_inodes,
+		    EZFS_INODE_BIT(EZFS_ROOT_INODE_NUMBER)) ||
+	    !S_ISDIR(root->mode) || !root->nblocks ||
+	    root->data_block_number < EZFS_ROOT_DATABLOCK_NUMBER ||
+	    root->data_block_number + root->nblocks > ezfs_dev_blocks(sb))
+		return invalfc(fc, "%s: bad root directory, run fsck.ezfs",
+				sb->s_id);
+	return 0;
+}
+
+/* Mounting reads two blocks, the superblock with the bitmaps and the inode
+ * store, and writes nothing. The inode store is read ahead while the
+ * superblock is checked, so both reads are in flight at once. All runtime
+ * state lives in ezfs_sb_buffer_heads, never in the on-disk superblock.
+ */
 static int ezfs_fill_super(struct super_block *sb, struct fs_context *fc)
 {
-	// create inode by iget_locked()
-	// associated a dentry
 	struct ezfs_sb_buffer_heads *sbh;
 	struct ezfs_super_block *ezfs_sb;
-	struct ezfs_inode *ez_ino;
 	struct inode *inode;
+	int err;
 
-	sbh = kzalloc(sizeof(*sbh), GFP_KERNEL);
-	if (!sbh)
-		return -ENOMEM;
+	// sget_fc already moved the state ezfs_init_fs_context set up into
+	// sb->s_fs_info; ezfs_kill_sb frees it, whether or not we succeed
+	sbh = sb->s_fs_info;
+	sbh->sb = sb;
 
-	sbh->sb_bh = kzalloc(sizeof(struct buffer_head), GFP_KERNEL);
-	sbh->i_store_bh = kzalloc(sizeof(struct buffer_head), GFP_KERNEL);
-	if (!sbh->sb_bh)
-		return -ENOMEM;
-	if (!sbh->i_store_bh)
+	if (!sb_set_blocksize(sb, EZFS_BLOCK_SIZE))
+		return invalfc(fc, "%s can't do %d byte blocks", sb->s_id,
+				EZFS_BLOCK_SIZE);
+	sbh->stats = alloc_percpu(struct ezfs_stats);
+	if (!sbh->stats)
 		return -ENOMEM;
-	//read and populate the sb_bh
-	sb_set_blocksize(sb, EZFS_BLOCK_SIZE);
-	sb->s_fs_info = sbh;
+	sb_breadahead(sb, EZFS_INODE_STORE_DATABLOCK_NUMBER);
 	sbh->sb_bh = sb_bread(sb, EZFS_SUPERBLOCK_DATABLOCK_NUMBER);
-	ezfs_sb = (struct ezfs_super_block *)sbh->sb_bh->b_data;
-	ezfs_sb->ezfs_lock = kzalloc(sizeof(struct mutex *), GFP_KERNEL);
-	if (!ezfs_sb->ezfs_lock) {
-		return -ENOMEM;
-	}
-	mutex_init(ezfs_sb->ezfs_lock);
-	// read and populate the i_store
+	if (!sbh->sb_bh)
+		return -EIO;
+	err = ezfs_check_super(sb, fc);
+	if (err)
+		goto out;
 	sbh->i_store_bh = sb_bread(sb, EZFS_INODE_STORE_DATABLOCK_NUMBER);
-	ez_ino = (struct ezfs_inode *) sbh->i_store_bh->b_data;
+	if (!sbh->i_store_bh) {
+		err = -EIO;
+		goto out;
+	}
+	err = ezfs_check_root(sb, fc);
+	if (err)
+		goto out;
+
+	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
+	// packed images never change, so they get no lock or allocator
+	sbh->packed = ezfs_sb->flags & EZFS_SB_PACKED;
+	sbh->data_blocks = min_t(uint64_t, ezfs_dev_blocks(sb) -
+			EZFS_ROOT_DATABLOCK_NUMBER, EZFS_MAX_DATA_BLKS);
+	if (sbh->packed)
+		sb->s_flags |= SB_RDONLY;
+	else if (!sb_rdonly(sb))
+		ezfs_sb->unused = 0;
+	mutex_init(&sbh->ezfs_lock);
+	spin_lock_init(&sbh->reclaim_lock);
+	INIT_LIST_HEAD(&sbh->reclaim_list);
+	INIT_DELAYED_WORK(&sbh->reclaim_work, ezfs_reclaim_worker);
+	mutex_init(&sbh->zstd_lock);
+	INIT_DELAYED_WORK(&sbh->commit_work, ezfs_commit_worker);
+	ezfs_check_discard(sb, &sbh->opts);
 	// fill out additional parameters
 	sb->s_magic = EZFS_MAGIC_NUMBER;
 	sb->s_op = &ezfs_sops;
 
 	// create root inode
 	inode = ezfs_get_inode(sb, NULL, EZFS_ROOT_INODE_NUMBER);
-
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out;
+	}
 	sb->s_root = d_make_root(inode);
-	if (!sb->s_root)
-		return -ENOMEM;
+	if (!sb->s_root) {
+		err = -ENOMEM;
+		goto out;
+	}
 
+	// from here on ezfs_put_super does the cleanup
+	if (sbh->opts.commit && !sb_rdonly(sb))
+		queue_delayed_work(system_unbound_wq, &sbh->commit_work,
+				sbh->opts.commit * HZ);
+	sbh->debugfs = debugfs_create_dir(sb->s_id, ezfs_debugfs_root);
+	debugfs_create_file("stats", 0444, sbh->debugfs, sbh,
+			&ezfs_stats_fops);
 	return 0;
 
+out:
+	brelse(sbh->i_store_bh);
+	brelse(sbh->sb_bh);
+	sbh->i_store_bh = NULL;
+	sbh->sb_bh = NULL;
+	return err;
 }
 
 static int ezfs_get_tree (struct fs_context *fc)
@@ -560,9 +2816,121 @@ static int ezfs_get_tree (struct fs_context *fc)
 	return get_tree_bdev(fc, ezfs_fill_super);
 }
 
+enum {
+	Opt_discard,
+	Opt_compress,
+	Opt_dir_prefetch,
+	Opt_alloc,
+	Opt_headroom,
+	Opt_reserved,
+	Opt_commit,
+};
+
+static const struct constant_table ezfs_param_compress[] = {
+	{"none",	EZFS_COMPR_NONE},
+	{"lz4",		EZFS_COMPR_LZ4},
+	{"zstd",	EZFS_COMPR_ZSTD},
+	{}
+};
+
+static const struct constant_table ezfs_param_alloc[] = {
+	{"first",	EZFS_ALLOC_FIRST},
+	{"next",	EZFS_ALLOC_NEXT},
+	{"best",	EZFS_ALLOC_BEST},
+	{}
+};
+
+static const struct fs_parameter_spec ezfs_fs_parameters[] = {
+	fsparam_flag_no("discard", Opt_discard),
+	fsparam_enum("compress", Opt_compress, ezfs_param_compress),
+	fsparam_flag_no("dir_prefetch", Opt_dir_prefetch),
+	fsparam_enum("alloc", Opt_alloc, ezfs_param_alloc),
+	fsparam_u32("headroom", Opt_headroom),
+	fsparam_u32("reserved", Opt_reserved),
+	fsparam_u32("commit", Opt_commit),
+	{}
+};
+
+static int ezfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+	struct ezfs_sb_buffer_heads *sbh = fc->s_fs_info;
+	struct fs_parse_result result;
+	int opt;
+
+	opt = fs_parse(fc, ezfs_fs_parameters, param, &result);
+	if (opt < 0)
+		return opt;
+
+	switch (opt) {
+	case Opt_discard:
+		sbh->opts.discard = !result.negated;
+		break;
+	case Opt_compress:
+		sbh->opts.compress = result.uint_32;
+		break;
+	case Opt_dir_prefetch:
+		sbh->opts.dir_prefetch = !result.negated;
+		break;
+	case Opt_alloc:
+		sbh->opts.alloc = result.uint_32;
+		break;
+	case Opt_headroom:
+		if (result.uint_32 > 100)
+			return invalfc(fc, "headroom must be at most 100");
+		sbh->opts.headroom = result.uint_32;
+		break;
+	case Opt_reserved:
+		if (result.uint_32 > 50)
+			return invalfc(fc, "reserved must be at most 50");
+		sbh->opts.reserved = result.uint_32;
+		break;
+	case Opt_commit:
+		if (result.uint_32 > 3600)
+			return invalfc(fc, "commit must be at most 3600");
+		sbh->opts.commit = result.uint_32;
+		break;
+	}
+	return 0;
+}
+
+/* mount -o remount: apply the new options to the live mount. Options not
+ * given keep their old values, since ezfs_init_fs_context started from them.
+ */
+static int ezfs_reconfigure(struct fs_context *fc)
+{
+	struct super_block *sb = fc->root->d_sb;
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+	struct ezfs_mount_opts *opts = &((struct ezfs_sb_buffer_heads *)
+			fc->s_fs_info)->opts;
+	bool rdonly = fc->sb_flags & SB_RDONLY;
+
+	if (sbh->packed && !rdonly)
+		return -EROFS;
+	// nothing may dirty the bitmaps behind sync_filesystem on the way to ro
+	if (rdonly && !sb_rdonly(sb)) {
+		flush_delayed_work(&sbh->reclaim_work);
+		cancel_delayed_work_sync(&sbh->commit_work);
+	}
+	sync_filesystem(sb);
+	ezfs_check_discard(sb, opts);
+
+	ezfs_lock_sb(sbh);
+	sbh->opts = *opts;
+	ezfs_unlock_sb(sbh);
+
+	if (sbh->opts.commit && !rdonly)
+		mod_delayed_work(system_unbound_wq, &sbh->commit_work,
+				sbh->opts.commit * HZ);
+	else
+		cancel_delayed_work_sync(&sbh->commit_work);
+	return 0;
+}
+
 static const struct fs_context_operations ezfs_context_ops = {
-	.free     = ezfs_free_fc,
-	.get_tree = ezfs_get_tree,
+	.free		= ezfs_free_fc,
+	.parse_param	= ezfs_parse_param,
+	.get_tree	= ezfs_get_tree,
+	.reconfigure	= ezfs_reconfigure,
 };
 
 // mount
@@ -573,6 +2941,10 @@ int ezfs_init_fs_context (struct fs_context *fc)
 	ezbh = kzalloc(sizeof(*ezbh), GFP_KERNEL);
 	if (!ezbh)
 		return -ENOMEM;
+	// a remount starts from the options the mount already has
+	if (fc->purpose == FS_CONTEXT_FOR_RECONFIGURE)
+		ezbh->opts = ((struct ezfs_sb_buffer_heads *)
+				fc->root->d_sb->s_fs_info)->opts;
 	fc->s_fs_info = ezbh;
 	fc->ops = &ezfs_context_ops;
 	return 0;
@@ -581,35 +2953,62 @@ int ezfs_init_fs_context (struct fs_context *fc)
 // umount
 static void ezfs_kill_sb (struct super_block *sb)
 {
-	struct ezfs_sb_buffer_heads *sbh;
-	struct ezfs_super_block *ezfs_sb;
-    sbh = sb->s_fs_info;
-	ezfs_sb = (struct ezfs_super_block *) sbh->sb_bh->b_data;
-	
-	mutex_destroy(ezfs_sb->ezfs_lock);
-	kfree(ezfs_sb->ezfs_lock);
-	brelse(sbh->sb_bh);
-	brelse(sbh->i_store_bh);
-	kfree(sb->s_fs_info);
+	struct ezfs_sb_buffer_heads *sbh = sb->s_fs_info;
+
+	// ezfs_put_super drops the buffers, the state itself is freed here
+	// so a mount that failed before s_root was set doesn't leak it
 	kill_block_super(sb);
+	free_percpu(sbh->stats);
+	kfree(sbh);
 }
 
 static struct file_system_type myezfs = {
 	.owner 		 = THIS_MODULE,
 	.name  		 = "myezfs",
 	.init_fs_context = ezfs_init_fs_context,
+	.parameters	 = ezfs_fs_parameters,
 	.kill_sb 	 = ezfs_kill_sb,
 };
 
+#ifdef EZFS_KUNIT_TEST
+#include "ezfs_test.c"
+#endif
+
 static int __init init_ezfs (void)
 {
-	return register_filesystem(&myezfs);
+	int err;
+
+	ezfs_inode_cachep = kmem_cache_create("ezfs_inode_cache",
+			sizeof(struct ezfs_inode_info), 0,
+			SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+			ezfs_inode_init_once);
+	if (!ezfs_inode_cachep)
+		return -ENOMEM;
+	ezfs_debugfs_root = debugfs_create_dir("ezfs", NULL);
+	err = register_filesystem(&myezfs);
+	if (err) {
+		debugfs_remove_recursive(ezfs_debugfs_root);
+		kmem_cache_destroy(ezfs_inode_cachep);
+		return err;
+	}
+#ifdef EZFS_KUNIT_TEST
+	__kunit_test_suites_init(ezfs_test_suites);
+#endif
+	return 0;
 }
 
 static void __exit exit_ezfs (void)
 {
+#ifdef EZFS_KUNIT_TEST
+	__kunit_test_suites_exit(ezfs_test_suites);
+#endif
 	unregister_filesystem(&myezfs);
+	debugfs_remove_recursive(ezfs_debugfs_root);
+	// free_inode runs after an RCU grace period
+	rcu_barrier();
+	kmem_cache_destroy(ezfs_inode_cachep);
 }
 
 module_init(init_ezfs);
-module_exit(exit_ezfs);
\ No newline at end of file
+module_exit(exit_ezfs);
+MODULE_LICENSE("GPL");
\ No newline at end of file